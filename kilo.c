@@ -5,25 +5,49 @@
 #define _GNU_SOURCE
 
 #include <ctype.h> // iscntrl()
+#include <pthread.h> // pthread_create(), pthread_mutex_lock(), pthread_cond_wait()
+#include <poll.h> // poll(), struct pollfd, POLLIN
+#include <signal.h> // sigaction(), SIGWINCH, sig_atomic_t
 #include <errno.h> // errno, EAGAIN
 #include <fcntl.h> // open(), O_RDWR, O_CREAT
+#include <limits.h> // INT_MAX, PATH_MAX
 #include <stdio.h> // printf(), perror(), snprintf(), FILE, fopen(), getline(), vsnprintf()
 #include <stdarg.h> // va_list, va_start(), va_end()
 #include <stdlib.h> // atexit(), exit(), realloc(), free(), malloc()
-#include <string.h> // memcpy(), strlen(), strdup(), memmove(), strerror(), strstr()
+#include <string.h> // memcpy(), strlen(), strdup(), memmove(), strerror(), strstr(), memchr()
+#include <stddef.h> // offsetof()
+#include <sys/inotify.h> // inotify_init1(), inotify_add_watch(), IN_MODIFY, for follow mode
 #include <sys/ioctl.h> // ioctl(), TIOCGWINSZ, struct winsize
+#include <sys/mman.h> // mmap(), munmap(), PROT_READ, MAP_PRIVATE, MAP_FAILED
+#include <sys/resource.h> // getrusage(), peak RSS for the headless build
+#include <sys/stat.h> // fstat(), struct stat, S_ISREG
 #include <sys/types.h> // ssize_t
+#include <sys/uio.h> // writev(), struct iovec
 #include <termios.h> // struct termios, tcgetattr(), tcsetattr(), ECHO, TCSAFLUSH, ICANON, ISIG, IXON, IEXTEN, ICRNL, OPOST, BRKINT, INPCK, ISTRIP, CS8, VMIN, VTIME
 #include <time.h> // time_t, time()
 #include <unistd.h> // read(), STDIN_FILENO, write(), STDOUT_FILENO, ftruncate(), close()
+#if defined(__SSE2__)
+#include <emmintrin.h> // __m128i, _mm_loadu_si128(), _mm_cmpeq_epi8(), _mm_movemask_epi8()
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h> // __m256i, _mm256_cmpeq_epi8(), only called when the CPU has AVX2
+#endif
 
 /*** defines ***/
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8 // configurable tab length
 #define KILO_QUIT_TIMES 3
+#define KILO_FPS 60 // most frames drawn per second
+#define KILO_UNDO_BYTES (16 << 20) // configurable cap on the memory undo history may use
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#define KILO_HAVE_AVX2 1 // built with a runtime check, see searchFind()
+#else
+#define KILO_HAVE_AVX2 0
+#endif
+
 enum editorKey 
 {
   BACKSPACE = 127,
@@ -35,17 +59,234 @@ enum editorKey
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  PASTE_START
+};
+
+enum editorHighlight
+{
+  HL_NORMAL = 0,
+  HL_COMMENT,
+  HL_MLCOMMENT,
+  HL_KEYWORD1,
+  HL_KEYWORD2,
+  HL_STRING,
+  HL_NUMBER
+};
+
+// where the lexer is at the end of a row
+enum editorLexState
+{
+  HLS_NORMAL = 0,
+  HLS_COMMENT, // inside a block comment
+  HLS_DQUOTE, // inside a "string" continued with a backslash
+  HLS_SQUOTE
 };
 
 /*** data ***/
+// Owned rows keep their text in a gap buffer: chars holds cap bytes, with the
+// row's text in [0, gap) and [gap + cap - size, cap). Typing at the cursor just
+// fills the gap, so it doesn't realloc or memmove the line on every keystroke.
+// Borrowed rows have no gap (gap == size == cap).
+#define KILO_RX_STEP 1024 // bytes between cx -> rx checkpoints in long rows
+#define KILO_WIDTH_STEP 64 // the same in rows with multibyte characters, however long
+
+// rx of cx k * step for k < valid. An edit at cx only makes the checkpoints
+// after it stale, so the ones before it are kept. Rows with multibyte
+// characters keep them closer together, since every one of their bytes
+// between two checkpoints has to be decoded again
+struct rxindex {
+  int valid, cap;
+  int step; // KILO_RX_STEP, or KILO_WIDTH_STEP once the row has a multibyte character
+  int rx[];
+};
+
 typedef struct erow {
   int size;
-  int rsize;
+  int cap;
+  int gap;
   char *chars;
-  char *render;
+  int owned; // chars was malloc'd for this row, otherwise it points into E.map and is read-only
+  int rdirty; // render needs to be rebuilt before it's used again
+  struct rcache *rc; // render of the row, only valid while rc -> gen == rgen
+  unsigned rgen;
+  struct rxindex *rxi; // only for rows longer than their step, NULL until needed
+  signed char utf8; // the row has bytes above 0x7f: 1 yes, 0 no, -1 not checked yet
+  unsigned char hl_start, hl_end; // lexer states the row was highlighted from and ended in
+  unsigned char hl_stale; // the row changed, or the state it starts from may have
+  unsigned char interned; // chars is the text of an iline other rows may share, see /*** line interning ***/
 } erow; // data type to store row of text in editor
 
+#define KILO_RENDER_CACHE 1024 // rendered rows kept around, at least 4 screens worth
+#define KILO_LONG_ROW 65536 // rows longer than this only get the columns around the screen rendered
+
+// Rows are rendered lazily, into entries of a fixed pool that are handed out
+// least recently used first. Taking an entry over bumps its gen, which is all
+// it takes to tell the previous owner that its render is gone.
+typedef struct rcache {
+  struct rcache *prev, *next; // LRU order, most recently used first
+  unsigned gen;
+  int rsize;
+  int rcap; // bytes allocated for render
+  int roff, rlim; // render holds columns [roff, rlim) of the row, everything for short rows
+  char *render;
+  unsigned char *hl; // highlight class of every byte of render
+  int hlcap;
+  int hl_ok; // hl matches render
+  int ascii; // render is plain ASCII, one byte per column
+} rcache;
+
+#define KILO_CHUNK_ROWS 512 // max rows held by one chunk of the document
+
+// The document is a treap of chunks of rows, ordered by position in the file.
+// Every node keeps the row and chunk counts of its subtree, so finding row n,
+// or inserting and deleting rows, costs O(log n) instead of moving a flat array.
+// Chunks are also linked in document order for walks over the whole file.
+// A chunk nobody has looked at yet is "cold": rows is NULL and it simply stands
+// for nrows lines of E.map starting at line number first. With a memory
+// budget, chunks that haven't been looked at for a while go cold again, see
+// /*** cold storage ***/; a chunk whose rows can't just be found in the
+// mapping again keeps them compressed in z instead.
+typedef struct chunk {
+  struct chunk *left, *right; // treap children
+  struct chunk *prev, *next; // neighbours in document order
+  unsigned prio; // treap heap priority
+  int nrows;
+  int tnrows; // rows in this subtree
+  int tnchunks; // chunks in this subtree
+  int first; // line index into E.lineoff, only meaningful while cold and z is NULL
+  erow *rows;
+  int shared; // rows also belong to the snapshot a background save is writing out
+  int edited; // changed since it was loaded, it no longer matches what it was loaded from
+  struct zblock *z; // the compressed rows of a cold chunk, kept while it's warm until it's edited
+  char *text; // z decompressed, the rows borrow from it like others do from the mapping
+  struct chunk *lru_prev, *lru_next; // warm chunks, most recently used first
+  unsigned touched; // CS.tick when it was last used
+} chunk;
+
+// the rows of a chunk, each followed by a newline, compressed with lzCompress()
+typedef struct zblock {
+  int refs; // the chunk, and the snapshot of a save writing it out
+  int nrows;
+  int rawlen, zlen;
+  char data[];
+} zblock;
+
+// A save writes out a snapshot of the document on a worker thread while
+// editing goes on. The snapshot is just the list of chunks as they were:
+// mapping ranges for cold chunks, and the rows arrays of warm ones. Those
+// arrays are marked shared, and the first edit to a shared chunk gives the
+// editor a copy to change (chunkEdit()) while the original stays with the
+// save until it's done.
+typedef struct snapchunk {
+  int first, nrows;
+  erow *rows; // NULL for cold chunks
+  zblock *z; // cold and compressed, the snapshot holds a reference to it
+  char *text; // orphans only: the decompressed block their rows borrow from
+} snapchunk;
+
+struct saveJob {
+  pthread_t thread;
+  int threaded; // thread is running the save, otherwise it was done in editorSave()
+  int active; // a save is in flight
+  int done; // set by the worker when it's finished
+  int failed, err;
+  char *filename;
+  snapchunk *chunks;
+  int nchunks;
+  snapchunk *orphans; // rows arrays the editor has moved away from, freed after the save
+  int norphans, orphcap;
+  long long total, bytes; // size of the snapshot, and how much has been written so far
+  int dirty; // E.dirty when the snapshot was taken
+  int shown; // percentage last put in the status bar
+  struct stat st; // the file written, which now has the name
+};
+
+// which version of a file an edit journal's records apply to, as stat() saw it
+struct journalBase {
+  long long size, mtime, mtime_nsec, ino;
+};
+
+// the edit journal, see /*** journal ***/
+struct journal {
+  int on; // the writer thread is running
+  int owned; // path is this editor's journal: it started it, or replayed it when the file was opened
+  int off; // 1: edits went unrecorded, nothing to journal until a save. 2: another journal is in the way
+  char *path;
+  struct journalBase base; // the file the records apply to
+  long long recovered; // bytes of a replayed journal to carry on from, 0 to start a new one
+  pthread_t thread;
+  pthread_mutex_t lock; // everything below is shared with the writer thread
+  pthread_cond_t cond;
+  int type, row, col, len, cap; // the open record, type -1 for none. Typing on extends it
+  char *text;
+  char *buf; // sealed records waiting for the writer
+  int blen, bcap;
+  char *keep; // records since the snapshot of a save in flight
+  int klen, kcap;
+  int keeping;
+  int rebase; // a save finished: start a new journal with keep
+  int reheader; // follow mode moved base on, write the header again
+  int stop;
+  int err; // errno of a failed write, the writer gave up
+  int warned;
+  long long records, bytes; // edits recorded, and the bytes of journal they took
+};
+
+// memory the document's rows take, and the budget that cold storage keeps it
+// under. See /*** cold storage ***/
+struct coldStore {
+  long long budget; // bytes, 0 for no budget: chunks stay warm once loaded
+  int warm; // chunks with rows
+  long long row_bytes; // buffers of owned rows
+  long long text_bytes; // decompressed blocks warm chunks borrow from
+  long long zbytes, zraw; // compressed blocks, and the bytes they stand for
+  int zblocks;
+  long long hits, misses; // row lookups that found their chunk warm, or had to load it
+  long long thaws; // blocks decompressed to load their chunk
+  chunk *lru_head, *lru_tail;
+  unsigned tick; // frames drawn, chunks used in the last one stay warm
+};
+
+// a line of text shared by every row that holds it, see /*** line interning ***/
+typedef struct iline {
+  struct iline *next; // in the same hash slot
+  unsigned hash;
+  int refs; // rows borrowing text
+  int len;
+  char text[];
+} iline;
+
+struct internTable {
+  int on; // kilo --intern
+  iline **slots;
+  int nslots, nlines;
+  long long rows; // rows borrowing a line
+  long long bytes, shared; // text of the lines, and of the rows that borrow them
+};
+
+// follow mode, see /*** follow ***/. off, ino, dev and partial describe what
+// editorOpen() loaded and are kept up to date whether following or not
+struct follow {
+  int on;
+  int fd; // the file, kept open to read what gets appended
+  int ifd, wd, dwd; // inotify instance, watches on the file and on its directory
+  int pending; // the file changed while a prompt was open, look once it's closed
+  off_t off; // bytes of the file loaded so far
+  ino_t ino;
+  dev_t dev;
+  int partial; // the last line had no newline yet, appended bytes continue it
+};
+
+// what the terminal currently shows on one screen line, so a frame only has to
+// send the lines that differ from the last one
+typedef struct screenline {
+  char *b;
+  int len;
+  unsigned hash;
+  int valid;
+} screenline;
+
 struct editorConfig 
 {
   int cx, cy;
@@ -55,20 +296,236 @@ struct editorConfig
   int screenrows;
   int screencols;
   int numrows;
-  erow *row;
+  chunk *root; // document tree
+  chunk *head, *tail; // first and last chunk
   int dirty;
   char *filename;
   char statusmsg[80];
   time_t statusmsg_time;
+  char *map; // read-only mapping of the opened file, NULL if the file was read with getline()
+  size_t maplen;
+  off_t *lineoff; // lineoff[i] is where line i of the mapping starts
+  int nlines;
+  double load_rate; // GB/s the mapping was indexed at, 0 if the file wasn't mapped or is small
+  int load_threads;
+  int searching; // the search prompt is open
+  int prompting; // the message bar holds a prompt, it doesn't expire
+  int search_icase;
+  int search_regex; // the query is a regular expression
+  struct editorSyntax *syntax; // NULL: no highlighting
+  int rcache_size; // entries in the pool of render buffers
+  rcache *rc_head, *rc_tail; // most and least recently used
+  screenline *shadow; // last frame sent, screenrows + 2 lines
+  int shadow_cy, shadow_cx; // where the terminal cursor was left
+  int shadow_rowoff, shadow_coloff; // offsets the last frame was drawn with
+  int frame_bytes; // bytes written by the last frame
+  long long total_bytes;
+  int frames;
+  int redraw; // something changed, a frame is due
+  long long last_frame; // when the last one was drawn, in ms
   struct termios orig_termios; // store original attributes
 };
 
 struct editorConfig E;
 
+/*** filetypes ***/
+#define HL_HIGHLIGHT_NUMBERS (1 << 0)
+#define HL_HIGHLIGHT_STRINGS (1 << 1)
+
+struct editorSyntax {
+  char *filetype;
+  char **filematch; // extensions starting with '.', or strings the name has to contain
+  char **keywords; // a trailing '|' marks a type keyword (second color)
+  char *singleline_comment_start;
+  char *multiline_comment_start;
+  char *multiline_comment_end;
+  int flags;
+};
+
+char *C_HL_extensions[] = {".c", ".h", ".cpp", ".cc", ".hpp", NULL};
+char *C_HL_keywords[] = {
+  "switch", "if", "while", "for", "break", "continue", "return", "else",
+  "struct", "union", "typedef", "static", "enum", "class", "case", "default",
+  "do", "goto", "sizeof", "const", "volatile", "extern", "inline", "#include",
+  "#define", "#if", "#ifdef", "#ifndef", "#endif", "#else", "#elif",
+
+  "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+  "void|", "short|", "size_t|", "ssize_t|", "off_t|", NULL
+};
+
+char *PY_HL_extensions[] = {".py", NULL};
+char *PY_HL_keywords[] = {
+  "def", "class", "if", "elif", "else", "for", "while", "return", "import",
+  "from", "as", "with", "try", "except", "finally", "raise", "pass", "break",
+  "continue", "lambda", "yield", "in", "not", "and", "or", "is", "global",
+
+  "None|", "True|", "False|", "self|", "int|", "str|", "list|", "dict|", NULL
+};
+
+struct editorSyntax HLDB[] = {
+  {"c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/", HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+  {"python", PY_HL_extensions, PY_HL_keywords, "#", NULL, NULL, HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
 /*** prototypes ***/
+extern struct saveJob SJ;
+extern struct follow FW;
+extern struct coldStore CS;
+void coldThaw(chunk *c);
+void coldWarm(chunk *c);
+void coldUnlink(chunk *c);
+void zblockPut(zblock *z);
+void coldTrim();
+extern struct internTable IT;
+char *internGet(const char *s, int len);
+void internRef(char *text);
+void internPut(char *text);
+int followPoll();
+void followSaved(struct stat *st);
+void journalRecord(int type, int row, int col, const char *s, int len);
+void journalRecover(struct stat *st);
+void journalCut();
+void journalSaved(int ok);
+void journalClose();
+void journalFollowed(struct stat *st);
+erow *editorRowAt(int at);
+static double benchNow();
 void editorSetStatusMessage(const char* fmt, ...);
 void editorRefreshScreen();
+void editorUpdateRow(erow *row);
+void editorUpdateWindow(erow *row, int from, int to);
+int editorIdle();
+void editorResize();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+#ifdef KILO_HEADLESS
+void vtSize(int *rows, int *cols);
+void vtWrite(const char *buf, int len);
+int benchInput(unsigned char *buf, int size);
+void benchWait();
+void initEditor();
+#endif
+
+/*** stats ***/
+// Where the time between a key arriving and the frame that shows it goes.
+// Collection is off until Ctrl-P turns it on (along with the overlay in the
+// message bar), and while it's off every probe costs a load and a branch.
+enum statStage {
+  STAT_READ, // decoding the key out of the input buffer
+  STAT_KEY, // handling it, not counting time spent waiting or decoding
+  STAT_PAINT, // building the frame
+  STAT_WRITE, // handing it to the terminal
+  STAT_TOTAL, // from the input arriving to the end of the frame that shows it
+  STAT_STAGES
+};
+
+const char *statNames[STAT_STAGES] = {"read", "key", "paint", "write", "total"};
+
+// Latencies go into log-linear buckets: below 8ns one per ns, above that four
+// per power of two, so any percentile is within 12.5%
+#define KILO_STAT_BUCKETS 256
+
+typedef struct histogram {
+  long long count, sum, max; // ns
+  unsigned bucket[KILO_STAT_BUCKETS];
+} histogram;
+
+struct stats {
+  int on;
+  histogram h[STAT_STAGES];
+  long long excluded; // ns spent waiting for and decoding keys, taken out of STAT_KEY
+  long long input_at; // when the oldest input not yet shown on screen arrived, 0 if none
+};
+
+struct stats ST;
+
+// monotonic ns, or 0 when collection is off
+static inline long long statNow() {
+  if (!ST.on) return 0;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int statBucket(long long ns) {
+  if (ns < 8) return ns < 0 ? 0 : ns;
+  int b = 63 - __builtin_clzll(ns);
+  return b * 4 + ((ns >> (b - 2)) & 3);
+}
+
+// smallest ns that goes into bucket k
+static long long statBucketFloor(int k) {
+  if (k < 8) return k;
+  return (long long)(4 + k % 4) << (k / 4 - 2);
+}
+
+void statRecord(int stage, long long ns) {
+  histogram *h = &ST.h[stage];
+  h -> count++;
+  h -> sum += ns;
+  if (ns > h -> max) h -> max = ns;
+  h -> bucket[statBucket(ns)]++;
+}
+
+// record the time since start, if collection was on when it was taken
+static inline void statEnd(int stage, long long start) {
+  if (start && ST.on) statRecord(stage, statNow() - start);
+}
+
+// ns below which a fraction p of the samples fall, to within a bucket
+long long statPercentile(histogram *h, double p) {
+  long long seen = 0, want = h -> count * p;
+  int k;
+  if (h -> count == 0) return 0;
+  for (k = 0; k < KILO_STAT_BUCKETS; k++) {
+    seen += h -> bucket[k];
+    if (seen > want) break;
+  }
+  long long ns = statBucketFloor(k) + statBucketFloor(k) / 8; // middle of the bucket
+  return ns < h -> max ? ns : h -> max;
+}
+
+void statToggle() {
+  ST.on = !ST.on;
+  if (ST.on) {
+    memset(ST.h, 0, sizeof(ST.h));
+    ST.input_at = 0;
+  }
+}
+
+// Ctrl-G: the summary and every non-empty bucket, times in microseconds
+int statDump(const char *filename) {
+  FILE *fp = fopen(filename, "w");
+  int j, k;
+  if (!fp) return -1;
+  fprintf(fp, "kilo latency stats, microseconds%s\n", ST.on ? "" : " (collection is off)");
+  fprintf(fp, "%-6s %10s %10s %10s %10s %10s %10s\n", "stage", "count", "mean", "p50", "p90", "p99", "max");
+  for (j = 0; j < STAT_STAGES; j++) {
+    histogram *h = &ST.h[j];
+    fprintf(fp, "%-6s %10lld %10.1f %10.1f %10.1f %10.1f %10.1f\n", statNames[j], h -> count,
+        h -> count ? h -> sum / 1e3 / h -> count : 0.0, statPercentile(h, 0.5) / 1e3,
+        statPercentile(h, 0.9) / 1e3, statPercentile(h, 0.99) / 1e3, h -> max / 1e3);
+  }
+  for (j = 0; j < STAT_STAGES; j++) {
+    fprintf(fp, "\n%s\n", statNames[j]);
+    for (k = 0; k < KILO_STAT_BUCKETS; k++)
+      if (ST.h[j].bucket[k]) fprintf(fp, "  >= %12.3f %10u\n", statBucketFloor(k) / 1e3, ST.h[j].bucket[k]);
+  }
+  return fclose(fp);
+}
+
+// the overlay: p50/p99 of each stage, in the message bar
+int statOverlay(char *buf, int size) {
+  int j, len = snprintf(buf, size, "us p50/p99");
+  for (j = 0; j < STAT_STAGES && len < size; j++) {
+    histogram *h = &ST.h[j];
+    len += snprintf(&buf[len], size - len, " %s %.0f/%.0f", statNames[j],
+        statPercentile(h, 0.5) / 1e3, statPercentile(h, 0.99) / 1e3);
+  }
+  if (len < size) len += snprintf(&buf[len], size - len, " (%lld keys)", ST.h[STAT_KEY].count);
+  return len < size ? len : size - 1;
+}
 
 /*** terminal ***/
 
@@ -83,6 +540,7 @@ void die(const char *s)
 
 void disableRawMode() 
 {
+  write(STDOUT_FILENO, "\x1b[?2004l", 8); // bracketed paste off
   // reset to original settings
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) die("tcsetattr"); 
 }
@@ -118,75 +576,222 @@ void enableRawMode()
   // IEXTEN disables Ctrl+V setting that waits for another character to be typed and then sends this character
   
   raw.c_cc[VMIN] = 0; // Sets min bytes of input needed before read() can return, set to 0 so read() returns as soon as input provided
-  raw.c_cc[VTIME] = 1; // Sets maximum time to wait before read() returns. Is specified in tenths of a second. Here set to 1/10 seconds or  100 milliseconds
-  // If read times out, 0 will be returned. (Typically returns number of bytes read)
+  raw.c_cc[VTIME] = 0; // Sets maximum time to wait before read() returns, in tenths of a second
+  // 0 means read() never waits: the waiting is done in poll(), see editorWait()
 
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr"); // apply changes
+  write(STDOUT_FILENO, "\x1b[?2004h", 8); // bracketed paste on, pastes arrive as <esc>[200~ text <esc>[201~
 }
 
-int editorReadKey()
-{
-  int nread;
-  char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
-  {
-    if (nread == -1 && errno != EAGAIN) die("read");
+// Keys are decoded out of a buffer that each read() fills with as much as is
+// waiting, so a burst of input costs one syscall rather than one per byte
+#define KILO_INPUT_BUF 65536
+
+struct inputBuffer {
+  unsigned char buf[KILO_INPUT_BUF];
+  int pos, len;
+};
+
+struct inputBuffer IB;
+
+// wait up to timeout ms (-1: as long as it takes) for more input. Returns 0 if none came
+static int inputFill(int timeout) {
+  if (IB.pos == IB.len) {
+    IB.pos = IB.len = 0;
+  } else if (IB.len == KILO_INPUT_BUF) {
+    memmove(IB.buf, &IB.buf[IB.pos], IB.len - IB.pos);
+    IB.len -= IB.pos;
+    IB.pos = 0;
   }
+#ifdef KILO_HEADLESS
+  (void)timeout;
+  int nread = benchInput(&IB.buf[IB.len], KILO_INPUT_BUF - IB.len);
+#else
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+  if (poll(&pfd, 1, timeout) <= 0) return 0;
+  int nread = read(STDIN_FILENO, &IB.buf[IB.len], KILO_INPUT_BUF - IB.len);
+  if (nread == -1 && errno != EAGAIN) die("read");
+#endif
+  if (nread <= 0) return 0;
+  if (ST.on && ST.input_at == 0) ST.input_at = statNow();
+  IB.len += nread;
+  return 1;
+}
 
-  if (c == '\x1b') 
-  {
-    char seq[3];
+// next byte of input, or -1 if none arrived within 100ms
+static int inputByte() {
+  if (IB.pos == IB.len && !inputFill(100)) return -1;
+  return IB.buf[IB.pos++];
+}
+
+// The event loop. Background threads and the SIGWINCH handler get it out of
+// poll() by writing a byte to wakefd, so an idle editor sleeps until something
+// actually happens.
+int wakefd[2] = {-1, -1};
+volatile sig_atomic_t editorResized = 0;
+
+// can be called from any thread, and from signal handlers
+void editorWake() {
+  char c = 0;
+  if (wakefd[1] != -1) write(wakefd[1], &c, 1); // if the pipe is full a wakeup is pending anyway
+}
+
+void editorHandleWinch(int sig) {
+  (void)sig;
+  editorResized = 1;
+  editorWake();
+}
 
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b'; // if time out, assume esc character
+static long long editorNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Sleep until there's input to read. A frame that is due gets drawn first,
+// but only once all queued input has been handled (so a burst of keys costs
+// one frame), and no sooner than 1/KILO_FPS after the previous one.
+void editorWait() {
+#ifdef KILO_HEADLESS
+  benchWait();
+  return;
+#endif
+  struct pollfd fds[3] = {{STDIN_FILENO, POLLIN, 0}, {wakefd[0], POLLIN, 0}, {FW.ifd, POLLIN, 0}}; // poll() skips fd -1
+  int timeout = -1;
+
+  if (FW.pending && !E.prompting && followPoll()) E.redraw = 1;
+
+  if (E.statusmsg[0] && !E.prompting) { // wake up to take the message down once it expires
+    long left = (E.statusmsg_time + 5 - time(NULL)) * 1000L;
+    if (left <= 0) {
+      E.statusmsg[0] = '\0';
+      E.redraw = 1;
+    } else {
+      timeout = left;
+    }
+  }
+  if (E.redraw) {
+    long long wait = E.last_frame + 1000 / KILO_FPS - editorNow();
+    if (wait > 0) {
+      if (timeout == -1 || wait < timeout) timeout = wait;
+    } else if (poll(fds, 1, 0) == 0 || wait < -100) { // nothing queued, or it's been a while
+      editorRefreshScreen();
+      coldTrim();
+    } else {
+      timeout = 0;
+    }
+  }
+
+  if (poll(fds, 3, timeout) <= 0) return;
+  if (fds[1].revents & POLLIN) {
+    char buf[64];
+    while (read(wakefd[0], buf, sizeof(buf)) > 0);
+    if (editorResized) {
+      editorResized = 0;
+      editorResize();
+    }
+    if (editorIdle()) E.redraw = 1;
+  }
+  if (fds[2].revents && followPoll()) E.redraw = 1;
+  if (fds[0].revents) inputFill(0);
+}
+
+// the next key out of the input buffer, which has at least one byte in it
+int editorDecodeKey()
+{
+  int c = IB.buf[IB.pos++];
+  if (c != '\x1b') return c;
 
-    if (seq[0] == '[') 
+  int seq = inputByte(); // if time out, assume esc character
+  if (seq == '[')
+  {
+    // <esc>[ then a number, maybe more ;-separated ones (modifiers, ignored), then the final byte
+    int n = 0, more = 0;
+    while ((c = inputByte()) != -1 && (isdigit(c) || c == ';'))
     {
-      if (seq[1] >= '0' && seq[1] <= '9')
-      {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-        if (seq[2] == '~')
-        {
-          switch (seq[1])
-          {
-            case '1': return HOME_KEY; 
-            case '3': return DEL_KEY; // delete key sends <esc>[3~
-            case '4': return END_KEY;
-            case '5': return PAGE_UP;
-            case '6': return PAGE_DOWN;
-            case '7': return HOME_KEY;
-            case '8': return END_KEY;
-          }
-        }
-      }
-      else
+      if (c == ';') more = 1;
+      else if (!more) n = n * 10 + c - '0';
+    }
+    if (c == '~')
+    {
+      switch (n)
       {
-        switch (seq[1]) 
-        {
-          case 'A': return ARROW_UP;
-          case 'B': return ARROW_DOWN;
-          case 'C': return ARROW_RIGHT;
-          case 'D': return ARROW_LEFT; // mapping arrow keys to wasd keys
-          case 'H': return HOME_KEY; // Home key could be sent as <esc>[1~, <esc>[7~, <esc>[H, or <esc>OH
-          case 'F': return END_KEY; // End key could be sent as <esc>[4~, <esc>[8~, <esc>[F, or <esc>OF
-        }
+        case 1: return HOME_KEY;
+        case 3: return DEL_KEY; // delete key sends <esc>[3~
+        case 4: return END_KEY;
+        case 5: return PAGE_UP;
+        case 6: return PAGE_DOWN;
+        case 7: return HOME_KEY;
+        case 8: return END_KEY;
+        case 200: return PASTE_START; // bracketed paste, see editorReadPaste()
       }
     }
-    else if (seq[0] == 'O') 
+    else
     {
-      switch (seq[1]) 
+      switch (c)
       {
-        case 'H': return HOME_KEY;
-        case 'F': return END_KEY;
+        case 'A': return ARROW_UP;
+        case 'B': return ARROW_DOWN;
+        case 'C': return ARROW_RIGHT;
+        case 'D': return ARROW_LEFT; // mapping arrow keys to wasd keys
+        case 'H': return HOME_KEY; // Home key could be sent as <esc>[1~, <esc>[7~, <esc>[H, or <esc>OH
+        case 'F': return END_KEY; // End key could be sent as <esc>[4~, <esc>[8~, <esc>[F, or <esc>OF
       }
     }
-
-    return '\x1b';
   }
-  else
+  else if (seq == 'O')
   {
-    return c;
+    switch (inputByte())
+    {
+      case 'H': return HOME_KEY;
+      case 'F': return END_KEY;
+    }
+  }
+
+  return '\x1b';
+}
+
+int editorReadKey()
+{
+  long long t = statNow();
+  while (IB.pos == IB.len) editorWait(); // frames are drawn in here
+  long long decode = statNow();
+  int c = editorDecodeKey();
+  if (t && ST.on) {
+    long long end = statNow();
+    statRecord(STAT_READ, end - decode);
+    ST.excluded += end - t;
+  }
+  return c;
+}
+
+// With bracketed paste on, the terminal wraps pasted text in <esc>[200~ and
+// <esc>[201~, so it can be taken as one block instead of as typed keys. This
+// returns the text after <esc>[200~ up to the end marker
+char *editorReadPaste(int *len) {
+  static const char end[] = "\x1b[201~";
+  const int endlen = sizeof(end) - 1;
+  int cap = 4096, n = 0, idle = 0;
+  char *buf = malloc(cap);
+  while (idle < 20) { // give up if the end marker doesn't come within 2 seconds
+    int c = inputByte();
+    if (c == -1) {
+      idle++;
+      continue;
+    }
+    idle = 0;
+    if (n == cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+    buf[n++] = c;
+    if (c == '~' && n >= endlen && memcmp(&buf[n - endlen], end, endlen) == 0) {
+      n -= endlen;
+      break;
+    }
   }
+  *len = n;
+  return buf;
 }
 
 int getCursorPosition(int *rows, int *cols)
@@ -197,7 +802,9 @@ int getCursorPosition(int *rows, int *cols)
   if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
 
   while (i < sizeof(buf) - 1) {
-    if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
+    int c = inputByte();
+    if (c == -1) break;
+    buf[i] = c;
     if (buf[i] == 'R') break;
     i++;
   }
@@ -210,6 +817,10 @@ int getCursorPosition(int *rows, int *cols)
 int getWindowSize(int *rows, int *cols)
 {
   struct winsize ws;
+#ifdef KILO_HEADLESS
+  vtSize(rows, cols);
+  return 0;
+#endif
 
   if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) 
   {
@@ -224,268 +835,4137 @@ int getWindowSize(int *rows, int *cols)
   }
 }
 
-/*** row operations ***/
-int editorRowCxToRx(erow *row, int cx) {
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++) {
-    if (row -> chars[j] == '\t')
-      rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-    rx++;
+/*** document ***/
+static int treeRows(chunk *t) { return t ? t -> tnrows : 0; }
+static int treeChunks(chunk *t) { return t ? t -> tnchunks : 0; }
+
+static void chunkPull(chunk *c) {
+  c -> tnrows = treeRows(c -> left) + c -> nrows + treeRows(c -> right);
+  c -> tnchunks = treeChunks(c -> left) + 1 + treeChunks(c -> right);
+}
+
+chunk *chunkNew(int first, int nrows) {
+  chunk *c = calloc(1, sizeof(chunk));
+  c -> prio = rand();
+  c -> first = first;
+  c -> nrows = nrows;
+  chunkPull(c);
+  return c;
+}
+
+// all chunks of a come before all chunks of b
+static chunk *treeMerge(chunk *a, chunk *b) {
+  if (!a) return b;
+  if (!b) return a;
+  if (a -> prio > b -> prio) {
+    a -> right = treeMerge(a -> right, b);
+    chunkPull(a);
+    return a;
   }
-  return rx;
+  b -> left = treeMerge(a, b -> left);
+  chunkPull(b);
+  return b;
 }
 
-int editorRowRxToCx(erow *row, int rx) {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row -> size; cx++)
-  {
-    if (row -> chars[cx] == '\t')
-      cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-    cur_rx++;
+// first k chunks of t go to *l, the rest to *r
+static void treeSplit(chunk *t, int k, chunk **l, chunk **r) {
+  if (!t) {
+    *l = *r = NULL;
+  } else if (k <= treeChunks(t -> left)) {
+    treeSplit(t -> left, k, l, &t -> left);
+    chunkPull(t);
+    *r = t;
+  } else {
+    treeSplit(t -> right, k - treeChunks(t -> left) - 1, &t -> right, r);
+    chunkPull(t);
+    *l = t;
+  }
+}
 
-    if (cur_rx > rx) return cx;
+// chunk holding row at, with *idx set to the row's index inside it and *rank
+// to the chunk's position among all chunks
+chunk *docLocate(int at, int *idx, int *rank) {
+  chunk *t = E.root;
+  int r = 0;
+  while (t) {
+    int lrows = treeRows(t -> left);
+    if (at < lrows) {
+      t = t -> left;
+      continue;
+    }
+    at -= lrows;
+    r += treeChunks(t -> left);
+    if (at < t -> nrows) {
+      *idx = at;
+      *rank = r;
+      return t;
+    }
+    at -= t -> nrows;
+    r++;
+    t = t -> right;
   }
-  return cx;
+  return NULL;
 }
 
-void editorUpdateRow(erow *row) {
-  int tabs = 0; 
-  int j;
-  for (j = 0; j < row -> size; j++)
-    if (row -> chars[j] == '\t') tabs++;
+// change the row count of the chunk at rank and of every subtree above it
+void docAdjust(int rank, int delta) {
+  chunk *t = E.root;
+  while (t) {
+    t -> tnrows += delta;
+    int lchunks = treeChunks(t -> left);
+    if (rank < lchunks) {
+      t = t -> left;
+    } else if (rank == lchunks) {
+      t -> nrows += delta;
+      return;
+    } else {
+      rank -= lchunks + 1;
+      t = t -> right;
+    }
+  }
+}
 
-  free(row -> render);
-  row -> render = malloc(row -> size + tabs * (KILO_TAB_STOP - 1) + 1);
+// link c in right after the chunk at rank, which is after (or at the front if NULL)
+void docInsertChunk(chunk *c, int rank, chunk *after) {
+  chunk *l, *r;
+  treeSplit(E.root, rank + 1, &l, &r);
+  E.root = treeMerge(treeMerge(l, c), r);
 
-  int idx = 0;
-  for (j = 0; j < row -> size; j++)
-  {
-    if (row -> chars[j] == '\t')
-    {
-      row -> render[idx++] = ' ';
-      while (idx % KILO_TAB_STOP != 0) row -> render[idx++] = ' ';
+  c -> prev = after;
+  c -> next = after ? after -> next : E.head;
+  if (c -> next) c -> next -> prev = c;
+  else E.tail = c;
+  if (after) after -> next = c;
+  else E.head = c;
+}
+
+void docRemoveChunk(chunk *c, int rank) {
+  chunk *l, *m, *r;
+  treeSplit(E.root, rank, &l, &r);
+  treeSplit(r, 1, &m, &r);
+  E.root = treeMerge(l, r);
+
+  if (c -> prev) c -> prev -> next = c -> next;
+  else E.head = c -> next;
+  if (c -> next) c -> next -> prev = c -> prev;
+  else E.tail = c -> prev;
+  if (c -> rows) coldUnlink(c); // emptied by edits, so it has no block or text left
+  free(c -> rows);
+  free(c);
+}
+
+// bytes of line n of the mapping, without the line ending
+const char *editorLineBytes(int n, int *len) {
+  off_t start = E.lineoff[n];
+  off_t end = n + 1 < E.nlines ? E.lineoff[n + 1] : (off_t)E.maplen;
+  if (end > start && E.map[end - 1] == '\n') end--;
+  if (end > start && E.map[end - 1] == '\r') end--;
+  *len = end - start;
+  return E.map + start;
+}
+
+// a row that borrows size bytes at chars
+void rowBorrow(erow *row, char *chars, int size) {
+  row -> chars = chars;
+  row -> size = size;
+  row -> cap = row -> gap = row -> size;
+  row -> owned = 0;
+  row -> interned = 0;
+  row -> rdirty = 1;
+  row -> rc = NULL;
+  row -> rxi = NULL;
+  row -> utf8 = -1;
+  row -> hl_start = row -> hl_end = HLS_NORMAL;
+  row -> hl_stale = 1;
+}
+
+// c gets the rows made for it
+void chunkWarm(chunk *c, erow *rows) {
+  // search workers may be reading the chunk, they must see either NULL or finished rows
+  __atomic_store_n(&c -> rows, rows, __ATOMIC_RELEASE);
+  c -> edited = 0;
+  CS.misses++;
+  coldWarm(c);
+}
+
+// give a cold chunk its rows. They borrow their chars from the mapping, or
+// from the decompressed block, so nothing is copied until a row is edited
+void chunkLoad(chunk *c) {
+  int j, len;
+  erow *rows = malloc(sizeof(erow) * KILO_CHUNK_ROWS);
+  char *p = NULL;
+  if (c -> z) {
+    coldThaw(c);
+    p = c -> text;
+  }
+  for (j = 0; j < c -> nrows; j++) {
+    if (p) {
+      char *nl = memchr(p, '\n', c -> text + c -> z -> rawlen - p);
+      rowBorrow(&rows[j], p, nl - p);
+      p = nl + 1;
     } else {
-      row -> render[idx++] = row -> chars[j];
+      const char *line = editorLineBytes(c -> first + j, &len);
+      rowBorrow(&rows[j], (char *)line, len);
     }
   }
-  row -> render[idx] = '\0';
-  row -> rsize = idx;
+  chunkWarm(c, rows);
 }
 
-void editorInsertRow(int at, char *s, size_t len)
-{
-  if (at < 0 || at > E.numrows) return;
+void editorFreeRow(erow *row);
+void editorRowOwn(erow *row);
+
+// get c ready to be changed: load it if it's cold, and if a save is still
+// writing its rows, swap in a private copy of them
+void chunkEdit(chunk *c) {
+  int j;
+  if (c -> rows == NULL) chunkLoad(c);
+  c -> edited = 1;
+  if (c -> shared) {
+    erow *rows = malloc(sizeof(erow) * KILO_CHUNK_ROWS);
+    memcpy(rows, c -> rows, sizeof(erow) * c -> nrows);
+    for (j = 0; j < c -> nrows; j++) {
+      if (rows[j].interned) internRef(rows[j].chars);
+      if (!rows[j].owned) continue;
+      rows[j].chars = malloc(rows[j].cap);
+      memcpy(rows[j].chars, c -> rows[j].chars, rows[j].cap);
+      CS.row_bytes += rows[j].cap;
+    }
+    if (SJ.norphans == SJ.orphcap) {
+      SJ.orphcap = SJ.orphcap ? SJ.orphcap * 2 : 16;
+      SJ.orphans = realloc(SJ.orphans, sizeof(snapchunk) * SJ.orphcap);
+    }
+    SJ.orphans[SJ.norphans].rows = c -> rows;
+    SJ.orphans[SJ.norphans].nrows = c -> nrows;
+    SJ.orphans[SJ.norphans].text = c -> text; // the orphaned rows may still borrow from it
+    SJ.norphans++;
+    if (c -> text) CS.text_bytes -= c -> z -> rawlen;
+    c -> rows = rows;
+    c -> shared = 0;
+    c -> text = NULL;
+  }
+  if (c -> z) {
+    // the block is about to be out of date: the rows get their own copies and let go of it
+    for (j = 0; j < c -> nrows; j++)
+      if (!c -> rows[j].owned) editorRowOwn(&c -> rows[j]);
+    if (c -> text) {
+      free(c -> text);
+      CS.text_bytes -= c -> z -> rawlen;
+    }
+    c -> text = NULL;
+    zblockPut(c -> z);
+    c -> z = NULL;
+  }
+}
 
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+void editorFreeDoc() {
+  chunk *c = E.head;
+  while (c) {
+    chunk *next = c -> next;
+    int j;
+    if (c -> rows)
+      for (j = 0; j < c -> nrows; j++) editorFreeRow(&c -> rows[j]);
+    free(c -> rows);
+    free(c -> text);
+    zblockPut(c -> z);
+    free(c);
+    c = next;
+  }
+  E.root = E.head = E.tail = NULL;
+  E.numrows = 0;
+  CS.warm = 0;
+  CS.text_bytes = 0;
+  CS.lru_head = CS.lru_tail = NULL;
+}
 
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+/*** cold storage ***/
+// With a memory budget (kilo --budget MB), chunks nobody has used for a while
+// give their rows up once the rows of the document take more than that. A
+// chunk that still is what it was loaded from just goes cold again, its rows
+// come back from the mapping or from its block the next time they're needed.
+// Any other chunk (edited, read with getline(), appended in follow mode) is
+// compressed first: its lines go into one block, packed with a small LZ77
+// codec laid out like LZ4's. Log files, with the same timestamps and prefixes
+// on every line, typically shrink 5-10x. Searches and saves decompress blocks
+// on their own threads, without warming the chunk up.
+#define KILO_LZ_HASH 14 // bits of the hash table that finds earlier occurrences
+#define KILO_LZ_MIN 4 // shortest match
 
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  editorUpdateRow(&E.row[at]);
+struct coldStore CS;
 
-  E.numrows++;
-  E.dirty++;
+static int lzBound(int n) {
+  return n + n / 255 + 16;
 }
 
-void editorFreeRow(erow *row) {
-  free(row -> render);
-  free(row -> chars);
+// a literal run or match too long for its 4 bits of the token: 255s and the rest
+static int lzLength(unsigned char *dst, int op, int len) {
+  for (; len >= 255; len -= 255) dst[op++] = 255;
+  dst[op++] = len;
+  return op;
 }
 
-void editorDelRow(int at) {
-  if (at < 0 || at >= E.numrows) return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-  E.numrows--;
-  E.dirty++;
+// one sequence: a token, nlit literals, then a match of len bytes off bytes
+// back. The last sequence has literals only, len is 0
+static int lzSequence(unsigned char *dst, int op, const unsigned char *lit, int nlit, int off, int len) {
+  int ml = len ? len - KILO_LZ_MIN : 0;
+  dst[op++] = (nlit < 15 ? nlit : 15) << 4 | (ml < 15 ? ml : 15);
+  if (nlit >= 15) op = lzLength(dst, op, nlit - 15);
+  memcpy(&dst[op], lit, nlit);
+  op += nlit;
+  if (len) {
+    dst[op++] = off & 0xff;
+    dst[op++] = off >> 8;
+    if (ml >= 15) op = lzLength(dst, op, ml - 15);
+  }
+  return op;
 }
 
-void editorRowInsertChar(erow *row, int at, int c) {
-  if (at < 0 || at > row -> size) at = row -> size;
-  row -> chars = realloc(row -> chars, row -> size + 2);
-  memmove(&row -> chars[at + 1], &row -> chars[at], row -> size - at + 1);
-  row -> size++;
-  row -> chars[at] = c;
-  editorUpdateRow(row);
-  E.dirty++;
+// compress n bytes into out, which has room for lzBound(n). Returns the compressed size
+int lzCompress(const char *in, int n, char *out) {
+  const unsigned char *src = (const unsigned char *)in;
+  unsigned char *dst = (unsigned char *)out;
+  int *table = calloc(1 << KILO_LZ_HASH, sizeof(int)); // 1 + where 4 bytes with each hash were last seen
+  int ip = 0, anchor = 0, op = 0;
+  while (ip + KILO_LZ_MIN <= n) {
+    unsigned seq;
+    memcpy(&seq, &src[ip], 4);
+    unsigned h = (seq * 2654435761u) >> (32 - KILO_LZ_HASH);
+    int ref = table[h] - 1;
+    table[h] = ip + 1;
+    if (ref < 0 || ip - ref > 65535 || memcmp(&src[ref], &src[ip], KILO_LZ_MIN) != 0) {
+      ip += 1 + ((ip - anchor) >> 6); // step faster through data that doesn't compress
+      continue;
+    }
+    int len = KILO_LZ_MIN;
+    while (ip + len < n && src[ref + len] == src[ip + len]) len++;
+    op = lzSequence(dst, op, &src[anchor], ip - anchor, ip - ref, len);
+    ip += len;
+    anchor = ip;
+  }
+  op = lzSequence(dst, op, &src[anchor], n - anchor, 0, 0);
+  free(table);
+  return op;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-  row -> chars = realloc(row -> chars, row -> size + len + 1);
-  memcpy(&row -> chars[row -> size], s, len);
-  row -> size += len;
-  row -> chars[row -> size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
+// decompress zlen bytes into the n bytes of out. A damaged block stops early
+// instead of writing outside out
+void lzDecompress(const char *in, int zlen, char *out, int n) {
+  const unsigned char *src = (const unsigned char *)in;
+  unsigned char *dst = (unsigned char *)out;
+  int ip = 0, op = 0, b;
+  while (ip < zlen) {
+    int token = src[ip++];
+    int nlit = token >> 4, len = token & 15;
+    if (nlit == 15) do {
+      b = ip < zlen ? src[ip++] : 0;
+      nlit += b;
+    } while (b == 255);
+    if (nlit > n - op || nlit > zlen - ip) return;
+    memcpy(&dst[op], &src[ip], nlit);
+    op += nlit;
+    ip += nlit;
+    if (ip + 2 > zlen) return; // the last sequence, it has no match
+    int off = src[ip] | src[ip + 1] << 8;
+    ip += 2;
+    if (len == 15) do {
+      b = ip < zlen ? src[ip++] : 0;
+      len += b;
+    } while (b == 255);
+    len += KILO_LZ_MIN;
+    if (off == 0 || off > op || len > n - op) return;
+    if (off >= len) {
+      memcpy(&dst[op], &dst[op - off], len);
+      op += len;
+    } else {
+      for (; len > 0; len--, op++) dst[op] = dst[op - off]; // the match overlaps what it writes
+    }
+  }
 }
 
-void editorRowDelChar(erow *row, int at) {
-  if (at < 0 || at >= row -> size) return;
-  memmove(&row -> chars[at], &row -> chars[at + 1], row -> size - at);
-  row -> size--;
-  editorUpdateRow(row);
-  E.dirty++;
+void zblockPut(zblock *z) {
+  if (z == NULL || --z -> refs > 0) return;
+  CS.zbytes -= z -> zlen;
+  CS.zraw -= z -> rawlen;
+  CS.zblocks--;
+  free(z);
 }
 
-/*** editor operations ***/
-void editorInsertChar(int c) {
-  if (E.cy == E.numrows) {
-    editorInsertRow(E.numrows, "", 0);
+// the lines of a warm chunk, compressed into a new block
+static zblock *coldFreeze(chunk *c) {
+  int j, raw = 0, at = 0;
+  for (j = 0; j < c -> nrows; j++) raw += c -> rows[j].size + 1;
+  char *text = malloc(raw + 1);
+  for (j = 0; j < c -> nrows; j++) {
+    erow *row = &c -> rows[j];
+    memcpy(&text[at], row -> chars, row -> gap);
+    memcpy(&text[at + row -> gap], &row -> chars[row -> gap + row -> cap - row -> size], row -> size - row -> gap);
+    at += row -> size;
+    text[at++] = '\n';
   }
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  E.cx++;
+  zblock *z = malloc(sizeof(zblock) + lzBound(raw));
+  z -> zlen = lzCompress(text, raw, z -> data);
+  z = realloc(z, sizeof(zblock) + z -> zlen);
+  z -> refs = 1;
+  z -> nrows = c -> nrows;
+  z -> rawlen = raw;
+  CS.zbytes += z -> zlen;
+  CS.zraw += raw;
+  CS.zblocks++;
+  free(text);
+  return z;
 }
 
-void editorInsertNewline() {
-  if (E.cx == 0) {
-    editorInsertRow(E.cy, "", 0);
-  } else {
-    erow *row = &E.row[E.cy];
-    editorInsertRow(E.cy + 1, &row -> chars[E.cx], row -> size - E.cx);
-    row = &E.row[E.cy];
-    row -> size = E.cx;
-    row -> chars[row -> size] = '\0';
-    editorUpdateRow(row);
+// decompress the block of a cold chunk into its text, for chunkLoad()
+void coldThaw(chunk *c) {
+  c -> text = malloc(c -> z -> rawlen + 1);
+  lzDecompress(c -> z -> data, c -> z -> zlen, c -> text, c -> z -> rawlen);
+  CS.text_bytes += c -> z -> rawlen;
+  CS.thaws++;
+}
+
+static void lruUnlink(chunk *c) {
+  if (c -> lru_prev) c -> lru_prev -> lru_next = c -> lru_next;
+  else CS.lru_head = c -> lru_next;
+  if (c -> lru_next) c -> lru_next -> lru_prev = c -> lru_prev;
+  else CS.lru_tail = c -> lru_prev;
+}
+
+static void lruPushFront(chunk *c) {
+  c -> lru_prev = NULL;
+  c -> lru_next = CS.lru_head;
+  if (CS.lru_head) CS.lru_head -> lru_prev = c;
+  else CS.lru_tail = c;
+  CS.lru_head = c;
+}
+
+// c just got its rows
+void coldWarm(chunk *c) {
+  lruPushFront(c);
+  c -> touched = CS.tick;
+  CS.warm++;
+}
+
+// c is giving its rows up
+void coldUnlink(chunk *c) {
+  lruUnlink(c);
+  CS.warm--;
+}
+
+// a row of c is being used
+static inline void coldTouch(chunk *c) {
+  c -> touched = CS.tick;
+  if (CS.lru_head == c) return;
+  lruUnlink(c);
+  lruPushFront(c);
+}
+
+// bytes the rows of the document take
+long long coldResident() {
+  return (long long)CS.warm * KILO_CHUNK_ROWS * sizeof(erow) + CS.row_bytes + CS.text_bytes;
+}
+
+// take the rows of c away, compressing them first unless they can be loaded again as they are
+static void coldEvict(chunk *c) {
+  int j;
+  if (c -> edited) c -> z = coldFreeze(c); // chunkEdit() already let go of any block it had
+  for (j = 0; j < c -> nrows; j++) editorFreeRow(&c -> rows[j]);
+  free(c -> rows);
+  c -> rows = NULL;
+  if (c -> text) {
+    free(c -> text);
+    CS.text_bytes -= c -> z -> rawlen;
+    c -> text = NULL;
   }
-  E.cy++;
-  E.cx = 0;
+  c -> edited = 0;
+  coldUnlink(c);
+}
+
+// Called after each frame: the least recently used chunks go cold until the
+// rows fit the budget again. Chunks the frame used stay, and so do those a
+// save is writing out, or that search workers may be reading
+void coldTrim() {
+  chunk *c = CS.lru_tail;
+  if (CS.budget && !E.searching) {
+    while (c && c -> touched != CS.tick && coldResident() > CS.budget) {
+      chunk *prev = c -> lru_prev;
+      if (!c -> shared) coldEvict(c);
+      c = prev;
+    }
+  }
+  CS.tick++;
+}
+
+// Ctrl-K: where the memory of the rows goes
+void coldStatus() {
+  long long lookups = CS.hits + CS.misses;
+  char budget[24] = "";
+  if (CS.budget) snprintf(budget, sizeof(budget), "/%lld", CS.budget >> 20);
+  editorSetStatusMessage("rows %.1f%s MB, %d warm | %d blocks %.1f MB %.1fx | %.2f%% hits %lld thaws",
+      coldResident() / 1048576.0, budget, CS.warm, CS.zblocks, CS.zbytes / 1048576.0,
+      CS.zbytes ? (double)CS.zraw / CS.zbytes : 0.0, lookups ? 100.0 * CS.hits / lookups : 100.0, CS.thaws);
+}
+
+/*** line interning ***/
+// Logs and CSV files repeat the same lines over and over. With kilo --intern
+// the lines read from a file that couldn't be mapped (a pipe, say) and the
+// ones follow mode appends are looked up in a hash table, and rows with the
+// same text borrow one shared copy of it, the way other rows borrow from the
+// mapping. The shared text is never changed: the first edit to a row gives it
+// a copy of its own (editorRowOwn()), and a line is freed once no row borrows
+// it any more. Renders need nothing like this, they come from a fixed pool.
+// Ctrl-D shows what it saves.
+#define KILO_INTERN_SLOTS 4096 // first size of the hash table, it doubles as it fills up
+
+struct internTable IT;
+
+static inline iline *internLine(char *text) {
+  return (iline *)(text - offsetof(iline, text));
+}
+
+// FNV-1a taken 8 bytes at a time, every line read gets hashed so it has to
+// keep up with reading them
+static unsigned internHash(const char *s, int len) {
+  unsigned long long h = 14695981039346656037ull, w;
+  int j;
+  for (j = 0; j + 8 <= len; j += 8) {
+    memcpy(&w, s + j, 8);
+    h = (h ^ w) * 1099511628211ull;
+  }
+  w = 0;
+  memcpy(&w, s + j, len - j);
+  h = (h ^ w ^ len) * 1099511628211ull;
+  return h ^ (h >> 32);
+}
+
+static void internGrow() {
+  int n = IT.nslots ? IT.nslots * 2 : KILO_INTERN_SLOTS, j;
+  iline **slots = calloc(n, sizeof(iline *));
+  for (j = 0; j < IT.nslots; j++) {
+    iline *l = IT.slots[j];
+    while (l) {
+      iline *next = l -> next;
+      l -> next = slots[l -> hash & (n - 1)];
+      slots[l -> hash & (n - 1)] = l;
+      l = next;
+    }
+  }
+  free(IT.slots);
+  IT.slots = slots;
+  IT.nslots = n;
+}
+
+// the shared copy of s, made by the first row that has this text
+char *internGet(const char *s, int len) {
+  unsigned h = internHash(s, len);
+  iline *l;
+  if (IT.nlines >= IT.nslots) internGrow();
+  for (l = IT.slots[h & (IT.nslots - 1)]; l; l = l -> next)
+    if (l -> hash == h && l -> len == len && memcmp(l -> text, s, len) == 0) break;
+  if (l == NULL) {
+    l = malloc(sizeof(iline) + len);
+    l -> hash = h;
+    l -> refs = 0;
+    l -> len = len;
+    memcpy(l -> text, s, len);
+    l -> next = IT.slots[h & (IT.nslots - 1)];
+    IT.slots[h & (IT.nslots - 1)] = l;
+    IT.nlines++;
+    IT.bytes += len;
+    CS.row_bytes += sizeof(iline) + len;
+  }
+  l -> refs++;
+  IT.rows++;
+  IT.shared += len;
+  return l -> text;
+}
+
+// another row borrows the line text belongs to
+void internRef(char *text) {
+  iline *l = internLine(text);
+  l -> refs++;
+  IT.rows++;
+  IT.shared += l -> len;
+}
+
+// a row lets go of its line
+void internPut(char *text) {
+  iline *l = internLine(text);
+  IT.rows--;
+  IT.shared -= l -> len;
+  if (--l -> refs) return;
+  iline **p = &IT.slots[l -> hash & (IT.nslots - 1)];
+  while (*p != l) p = &(*p) -> next;
+  *p = l -> next;
+  IT.nlines--;
+  IT.bytes -= l -> len;
+  CS.row_bytes -= sizeof(iline) + l -> len;
+  free(l);
+}
+
+// bytes saved against giving every row its own copy, as editorInsertRow() does
+long long internSaved() {
+  return IT.shared + IT.rows - IT.bytes - IT.nlines * (long long)sizeof(iline);
+}
+
+void internStatus() {
+  if (!IT.on) {
+    editorSetStatusMessage("Line interning is off, kilo --intern FILE turns it on");
+    return;
+  }
+  editorSetStatusMessage("%lld rows share %d lines, %.1fx | %.1f MB saved",
+      IT.rows, IT.nlines, IT.nlines ? (double)IT.rows / IT.nlines : 0.0, internSaved() / 1048576.0);
+}
+
+/*** render cache ***/
+void rcacheUnlink(rcache *rc) {
+  if (rc -> prev) rc -> prev -> next = rc -> next;
+  else E.rc_head = rc -> next;
+  if (rc -> next) rc -> next -> prev = rc -> prev;
+  else E.rc_tail = rc -> prev;
+}
+
+void rcachePushFront(rcache *rc) {
+  rc -> prev = NULL;
+  rc -> next = E.rc_head;
+  if (E.rc_head) E.rc_head -> prev = rc;
+  else E.rc_tail = rc;
+  E.rc_head = rc;
+}
+
+void rcachePushBack(rcache *rc) {
+  rc -> next = NULL;
+  rc -> prev = E.rc_tail;
+  if (E.rc_tail) E.rc_tail -> next = rc;
+  else E.rc_head = rc;
+  E.rc_tail = rc;
+}
+
+// make sure the pool has at least size entries. It only ever grows, since rows
+// keep pointers to the entries they were given
+void rcacheReserve(int size) {
+  int j;
+  if (size <= E.rcache_size) return;
+  rcache *block = calloc(size - E.rcache_size, sizeof(rcache));
+  for (j = 0; j < size - E.rcache_size; j++) rcachePushBack(&block[j]);
+  E.rcache_size = size;
+}
+
+// the row's render, built now if it was never built, was evicted or is stale.
+// Long rows are rendered for the cols columns from coloff, with a screen's
+// width of slack on both sides so short horizontal scrolls reuse it
+rcache *editorRowRender(erow *row, int coloff, int cols) {
+  rcache *rc = row -> rc;
+  if (rc == NULL || rc -> gen != row -> rgen) {
+    rc = E.rc_tail;
+    rc -> gen++;
+    if (rc -> rcap > 65536) { // don't let one huge line pin its buffer forever
+      free(rc -> render);
+      free(rc -> hl);
+      rc -> render = NULL;
+      rc -> hl = NULL;
+      rc -> rcap = rc -> hlcap = 0;
+    }
+    row -> rc = rc;
+    row -> rgen = rc -> gen;
+    row -> rdirty = 1;
+  }
+  rcacheUnlink(rc);
+  rcachePushFront(rc);
+  if (row -> size > KILO_LONG_ROW) {
+    if (coloff < rc -> roff || coloff + cols > rc -> rlim) row -> rdirty = 1;
+    if (row -> rdirty) editorUpdateWindow(row, coloff - cols, coloff + 2 * cols);
+  } else if (row -> rdirty) {
+    editorUpdateRow(row);
+  }
+  return rc;
+}
+
+// give the row's entry back to the pool, first in line to be reused
+void editorRowReleaseRender(erow *row) {
+  rcache *rc = row -> rc;
+  row -> rc = NULL;
+  if (rc == NULL || rc -> gen != row -> rgen) return;
+  rc -> gen++;
+  rcacheUnlink(rc);
+  rcachePushBack(rc);
+}
+
+/*** unicode ***/
+// Text is taken to be UTF-8. A character is as many columns wide as the
+// terminal will make it: 2 for the East Asian wide and fullwidth ranges and
+// most emoji, 0 for combining marks and other zero-width characters, 1 for
+// everything else. Malformed bytes count as one column each.
+struct widthRange {
+  unsigned first, last;
+};
+
+static const struct widthRange zeroWidth[] = {
+  {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF},
+  {0x05C1, 0x05C2}, {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A},
+  {0x064B, 0x065F}, {0x0670, 0x0670}, {0x06D6, 0x06DC}, {0x06DF, 0x06E4},
+  {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0711, 0x0711}, {0x0730, 0x074A},
+  {0x0900, 0x0902}, {0x093A, 0x093A}, {0x093C, 0x093C}, {0x0941, 0x0948},
+  {0x094D, 0x094D}, {0x0951, 0x0957}, {0x0E31, 0x0E31}, {0x0E34, 0x0E3A},
+  {0x0E47, 0x0E4E}, {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF}, {0x200B, 0x200F},
+  {0x202A, 0x202E}, {0x2060, 0x2064}, {0x20D0, 0x20FF}, {0x302A, 0x302D},
+  {0x3099, 0x309A}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF},
+  {0xE0001, 0xE0001}, {0xE0020, 0xE007F}, {0xE0100, 0xE01EF}
+};
+
+static const struct widthRange wideWidth[] = {
+  {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC},
+  {0x23F0, 0x23F0}, {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615},
+  {0x2648, 0x2653}, {0x267F, 0x267F}, {0x2693, 0x2693}, {0x26A1, 0x26A1},
+  {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5}, {0x26CE, 0x26CE},
+  {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+  {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B},
+  {0x2728, 0x2728}, {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755},
+  {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27B0, 0x27B0}, {0x27BF, 0x27BF},
+  {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55}, {0x2E80, 0x303E},
+  {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+  {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19},
+  {0xFE30, 0xFE6F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4},
+  {0x17000, 0x18CFF}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF},
+  {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F251}, {0x1F300, 0x1F64F},
+  {0x1F680, 0x1F6FF}, {0x1F7E0, 0x1F7EB}, {0x1F900, 0x1F9FF}, {0x1FA70, 0x1FAFF},
+  {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD}
+};
+
+static int inRanges(unsigned cp, const struct widthRange *r, int n) {
+  int lo = 0, hi = n - 1;
+  if (cp < r[0].first || cp > r[n - 1].last) return 0;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (cp < r[mid].first) hi = mid - 1;
+    else if (cp > r[mid].last) lo = mid + 1;
+    else return 1;
+  }
+  return 0;
+}
+
+// columns taken by code point cp
+int charWidth(unsigned cp) {
+  if (cp < 0x300) return 1;
+  if (inRanges(cp, zeroWidth, sizeof(zeroWidth) / sizeof(zeroWidth[0]))) return 0;
+  if (inRanges(cp, wideWidth, sizeof(wideWidth) / sizeof(wideWidth[0]))) return 2;
+  return 1;
+}
+
+// the code point the n bytes at s start with, and how many bytes it takes.
+// A malformed sequence (overlong, a surrogate, cut short) is its first byte
+// alone, standing for U+FFFD
+int utf8Decode(const unsigned char *s, int n, unsigned *cp) {
+  unsigned c = s[0];
+  int len, j;
+  if (c < 0x80) {
+    *cp = c;
+    return 1;
+  }
+  if (c >= 0xC2 && c <= 0xDF) { len = 2; c &= 0x1F; }
+  else if (c >= 0xE0 && c <= 0xEF) { len = 3; c &= 0x0F; }
+  else if (c >= 0xF0 && c <= 0xF4) { len = 4; c &= 0x07; }
+  else len = 0;
+  for (j = 1; j < len; j++) {
+    if (j >= n || (s[j] & 0xC0) != 0x80) {
+      len = 0;
+      break;
+    }
+    c = (c << 6) | (s[j] & 0x3F);
+  }
+  if ((len == 3 && (c < 0x800 || (c >= 0xD800 && c <= 0xDFFF))) || (len == 4 && (c < 0x10000 || c > 0x10FFFF))) len = 0;
+  if (len == 0) {
+    *cp = 0xFFFD;
+    return 1;
+  }
+  *cp = c;
+  return len;
+}
+
+// the bytes of a render with multibyte characters that fall in columns
+// [col, col + cols). A wide character cut by the left edge leaves *pad blank
+// columns before them, one cut by the right edge is left out
+void editorRenderClip(rcache *rc, int col, int cols, int *off, int *len, int *pad) {
+  const unsigned char *s = (const unsigned char *)rc -> render;
+  int j = 0, x = rc -> roff, n, w;
+  unsigned cp;
+  while (j < rc -> rsize && x < col) {
+    n = utf8Decode(s + j, rc -> rsize - j, &cp);
+    x += charWidth(cp);
+    j += n;
+  }
+  *pad = x > col ? x - col : 0;
+  if (*pad > cols) *pad = cols;
+  while (j < rc -> rsize) { // marks on the character before the edge go with it
+    n = utf8Decode(s + j, rc -> rsize - j, &cp);
+    if (charWidth(cp)) break;
+    j += n;
+  }
+  *off = j;
+  x = col + *pad;
+  while (j < rc -> rsize) {
+    n = utf8Decode(s + j, rc -> rsize - j, &cp);
+    w = charWidth(cp);
+    if (x + w > col + cols) break;
+    x += w;
+    j += n;
+  }
+  *len = j - *off;
+}
+
+/*** row operations ***/
+static inline char editorRowChar(erow *row, int j) {
+  return j < row -> gap ? row -> chars[j] : row -> chars[j + row -> cap - row -> size];
+}
+
+// number of tabs in s[0, n)
+static int tabCount(const char *s, int n) {
+  int j = 0, count = 0;
+#if defined(__SSE2__)
+  const __m128i tab = _mm_set1_epi8('\t');
+  for (; j + 16 <= n; j += 16)
+    count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + j)), tab)));
+#endif
+  for (; j < n; j++)
+    if (s[j] == '\t') count++;
+  return count;
+}
+
+// 1 if no byte of s[0, n) is above 0x7f, 16 bytes at a time with SSE2
+static int asciiOnly(const char *s, int n) {
+  int j = 0;
+#if defined(__SSE2__)
+  __m128i any = _mm_setzero_si128();
+  for (; j + 16 <= n; j += 16) any = _mm_or_si128(any, _mm_loadu_si128((const __m128i *)(s + j)));
+  if (_mm_movemask_epi8(any)) return 0;
+#endif
+  for (; j < n; j++)
+    if (s[j] & 0x80) return 0;
+  return 1;
+}
+
+// offset of the first byte of s[0, n) that isn't one column wide by itself,
+// a tab or a byte above 0x7f, or n
+static int plainScan(const char *s, int n) {
+  int j = 0;
+#if defined(__SSE2__)
+  const __m128i tab = _mm_set1_epi8('\t');
+  for (; j + 16 <= n; j += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + j));
+    int mask = _mm_movemask_epi8(v) | _mm_movemask_epi8(_mm_cmpeq_epi8(v, tab));
+    if (mask) return j + __builtin_ctz(mask);
+  }
+#endif
+  for (; j < n; j++)
+    if (s[j] == '\t' || (s[j] & 0x80)) break;
+  return j;
+}
+
+// the longest contiguous run of the row's text starting at cx and ending by end
+static inline const char *editorRowSpan(erow *row, int cx, int end, int *len) {
+  if (cx < row -> gap) {
+    *len = (end < row -> gap ? end : row -> gap) - cx;
+    return &row -> chars[cx];
+  }
+  *len = end - cx;
+  return &row -> chars[cx + row -> cap - row -> size];
+}
+
+// the code point at byte at of the row, and how many bytes it takes
+static int editorRowDecode(erow *row, int at, unsigned *cp) {
+  unsigned char buf[4];
+  int n = 0;
+  while (n < 4 && at + n < row -> size) {
+    buf[n] = editorRowChar(row, at + n);
+    n++;
+  }
+  return utf8Decode(buf, n, cp);
+}
+
+// the first byte of the character byte at is part of
+int editorRowCharStart(erow *row, int at) {
+  unsigned cp;
+  int j = at;
+  if (at >= row -> size) return at;
+  while (j > 0 && at - j < 3 && (editorRowChar(row, j) & 0xC0) == 0x80) j--;
+  if (j < at && editorRowDecode(row, j, &cp) > at - j) return j;
+  return at;
+}
+
+// 1 if the row has bytes above 0x7f. Checked with asciiOnly() the first time
+// it's asked, and kept up to date by inserts after that. Deletes leave it set,
+// which only costs the decoding the row would otherwise skip
+int editorRowMultibyte(erow *row) {
+  int cx, len;
+  if (row -> utf8 < 0) {
+    row -> utf8 = 0;
+    for (cx = 0; cx < row -> size && !row -> utf8; cx += len) {
+      const char *s = editorRowSpan(row, cx, row -> size, &len);
+      row -> utf8 = !asciiOnly(s, len);
+    }
+  }
+  return row -> utf8;
+}
+
+// the column reached after the characters starting in [from, to) of the row,
+// starting at column rx. A character counts all of its columns at its first
+// byte, so its other bytes add nothing and the sum can be cut anywhere.
+// Between tabs and multibyte characters plainScan() skips a run at a time
+static int editorRowAdvance(erow *row, int from, int to, int rx) {
+  unsigned cp;
+  int start = editorRowCharStart(row, from);
+  if (start < from) from = start + editorRowDecode(row, start, &cp); // counted before from
+  while (from < to) {
+    int len, j = 0;
+    const char *s = editorRowSpan(row, from, to, &len);
+    while (j < len) {
+      int run = plainScan(s + j, len - j);
+      rx += run;
+      j += run;
+      if (j == len) break;
+      if (s[j] == '\t') {
+        rx += KILO_TAB_STOP - (rx % KILO_TAB_STOP);
+        j++;
+      } else {
+        j += editorRowDecode(row, from + j, &cp); // may run past the span, into the next one
+        rx += charWidth(cp);
+      }
+    }
+    from += j;
+  }
+  return rx;
+}
+
+// bytes between the row's checkpoints
+static int editorRowStep(erow *row) {
+  return editorRowMultibyte(row) ? KILO_WIDTH_STEP : KILO_RX_STEP;
+}
+
+// make checkpoint k of a long row valid, building the missing ones from the last good one
+static struct rxindex *editorRowCheckpoints(erow *row, int k) {
+  struct rxindex *rxi = row -> rxi;
+  int step = editorRowStep(row);
+  int need = row -> size / step + 1;
+  if (rxi && rxi -> step != step) rxi -> valid = 1; // the row just got its first multibyte character
+  if (rxi == NULL || rxi -> cap < need) {
+    int cap = rxi && rxi -> cap * 2 > need ? rxi -> cap * 2 : need;
+    rxi = realloc(rxi, sizeof(struct rxindex) + sizeof(int) * cap);
+    if (row -> rxi == NULL) {
+      rxi -> valid = 1;
+      rxi -> rx[0] = 0;
+    }
+    rxi -> cap = cap;
+    row -> rxi = rxi;
+  }
+  rxi -> step = step;
+  for (; rxi -> valid <= k; rxi -> valid++) {
+    int j = rxi -> valid;
+    rxi -> rx[j] = editorRowAdvance(row, (j - 1) * step, j * step, rxi -> rx[j - 1]);
+  }
+  return rxi;
+}
+
+// Rows longer than their step keep a checkpoint every step bytes, so both
+// conversions start from the nearest one instead of from column 0
+int editorRowCxToRx(erow *row, int cx) {
+  int step = editorRowStep(row);
+  if (cx > row -> size) cx = row -> size;
+  if (row -> size <= step) return editorRowAdvance(row, 0, cx, 0);
+  int k = cx / step;
+  struct rxindex *rxi = editorRowCheckpoints(row, k);
+  return editorRowAdvance(row, k * step, cx, rxi -> rx[k]);
+}
+
+// the first byte of the character drawn at column rx
+int editorRowRxToCx(erow *row, int rx) {
+  int step = editorRowStep(row);
+  int cur_rx = 0;
+  int cx = 0;
+  unsigned cp;
+  if (row -> size > step) {
+    // the last checkpoint at or before rx, extending the index as far as needed
+    int last = row -> size / step;
+    struct rxindex *rxi = editorRowCheckpoints(row, 0);
+    while (rxi -> valid <= last && rxi -> rx[rxi -> valid - 1] <= rx)
+      rxi = editorRowCheckpoints(row, rxi -> valid);
+    int lo = 0, hi = rxi -> valid - 1;
+    while (lo < hi) {
+      int mid = (lo + hi + 1) / 2;
+      if (rxi -> rx[mid] <= rx) lo = mid;
+      else hi = mid - 1;
+    }
+    cx = editorRowCharStart(row, lo * step);
+    if (cx < lo * step) cx += editorRowDecode(row, cx, &cp); // counted before the checkpoint
+    cur_rx = rxi -> rx[lo];
+  }
+  while (cx < row -> size)
+  {
+    char c = editorRowChar(row, cx);
+    int n = 1;
+    if (c == '\t') {
+      cur_rx += KILO_TAB_STOP - (cur_rx % KILO_TAB_STOP);
+    } else if (c & 0x80) {
+      n = editorRowDecode(row, cx, &cp);
+      cur_rx += charWidth(cp);
+    } else {
+      cur_rx++;
+    }
+
+    if (cur_rx > rx) return cx;
+    cx += n;
+  }
+  return cx;
+}
+
+// fill the row's render entry, expanding tabs. Runs between tabs and
+// multibyte characters are found with plainScan() and copied whole, so rows
+// that are plain ASCII never get decoded. Malformed bytes show as '?'
+void editorUpdateRow(erow *row) {
+  rcache *rc = row -> rc;
+  int tabs = 0;
+  int cx, len;
+  for (cx = 0; cx < row -> size; cx += len) {
+    const char *s = editorRowSpan(row, cx, row -> size, &len);
+    tabs += tabCount(s, len);
+  }
+
+  // render is only reallocated when it has to grow
+  int need = row -> size + tabs * (KILO_TAB_STOP - 1) + 1;
+  if (need > rc -> rcap) {
+    free(rc -> render);
+    rc -> render = malloc(need);
+    rc -> rcap = need;
+  }
+
+  int idx = 0, col = 0, ascii = 1;
+  for (cx = 0; cx < row -> size; )
+  {
+    const char *s = editorRowSpan(row, cx, row -> size, &len);
+    int j = 0;
+    while (j < len)
+    {
+      int run = plainScan(s + j, len - j);
+      memcpy(&rc -> render[idx], s + j, run);
+      idx += run;
+      col += run;
+      j += run;
+      if (j == len) break;
+      if (s[j] == '\t')
+      {
+        rc -> render[idx++] = ' ';
+        while (++col % KILO_TAB_STOP != 0) rc -> render[idx++] = ' ';
+        j++;
+      }
+      else
+      {
+        unsigned cp;
+        int k, n = editorRowDecode(row, cx + j, &cp);
+        if (n == 1) rc -> render[idx++] = '?';
+        else for (k = 0; k < n; k++) rc -> render[idx++] = editorRowChar(row, cx + j + k);
+        j += n;
+        col += charWidth(cp);
+        ascii = 0;
+      }
+    }
+    cx += j;
+  }
+  rc -> render[idx] = '\0';
+  rc -> rsize = idx;
+  rc -> roff = 0;
+  rc -> rlim = INT_MAX;
+  rc -> hl_ok = 0;
+  rc -> ascii = ascii;
+  row -> rdirty = 0;
+}
+
+// fill the row's render entry with columns [from, to) only. The checkpoints
+// find where the window starts, so this costs the window, not the row
+void editorUpdateWindow(erow *row, int from, int to) {
+  rcache *rc = row -> rc;
+  if (from < 0) from = 0;
+  int need = to - from + 1;
+  if (need > rc -> rcap) {
+    free(rc -> render);
+    rc -> render = malloc(need);
+    rc -> rcap = need;
+  }
+
+  int cx = editorRowRxToCx(row, from);
+  int rx = editorRowCxToRx(row, cx); // before from when a tab or a wide character straddles it
+  int idx = 0, ascii = 1, blank = 0;
+  while (cx < row -> size && rx <= to)
+  {
+    char c = editorRowChar(row, cx);
+    unsigned cp = (unsigned char)c;
+    int n = 1, j, w;
+    if (c & 0x80) n = editorRowDecode(row, cx, &cp);
+    w = c == '\t' ? KILO_TAB_STOP - (rx % KILO_TAB_STOP) : charWidth(cp);
+    if (rx == to && w > 0) break; // marks on the last character still go with it
+    while (idx + KILO_TAB_STOP + 4 >= rc -> rcap) { // multibyte characters take more than a byte per column
+      rc -> rcap *= 2;
+      rc -> render = realloc(rc -> render, rc -> rcap);
+    }
+    if (w == 0 && blank)
+    {
+      // marks on a character that was blanked go with it
+    }
+    else if (c == '\t' || rx < from || rx + w > to)
+    {
+      // tabs, and characters cut by an edge of the window, are blanks where they show
+      for (; w > 0; w--, rx++)
+        if (rx >= from && rx < to) rc -> render[idx++] = ' ';
+      blank = c != '\t';
+    }
+    else
+    {
+      blank = 0;
+      if (n == 1 && (c & 0x80)) rc -> render[idx++] = '?';
+      else for (j = 0; j < n; j++) rc -> render[idx++] = editorRowChar(row, cx + j);
+      if (c & 0x80) ascii = 0;
+      rx += w;
+    }
+    cx += n;
+  }
+  rc -> render[idx] = '\0';
+  rc -> rsize = idx;
+  rc -> roff = from;
+  rc -> rlim = to;
+  rc -> hl_ok = 0;
+  rc -> ascii = ascii;
+  row -> rdirty = 0;
+}
+
+// make room for a new row at at, for the caller to give its text
+static erow *editorInsertRowSlot(int at) {
+  chunk *c;
+  int idx, rank;
+  if (at == E.numrows) {
+    if (E.tail == NULL) {
+      chunk *n = chunkNew(0, 0);
+      n -> rows = malloc(sizeof(erow) * KILO_CHUNK_ROWS);
+      n -> edited = 1;
+      coldWarm(n);
+      docInsertChunk(n, -1, NULL);
+    }
+    c = E.tail;
+    idx = c -> nrows;
+    rank = treeChunks(E.root) - 1;
+  } else {
+    c = docLocate(at, &idx, &rank);
+  }
+  chunkEdit(c);
+  coldTouch(c);
+
+  if (c -> nrows == KILO_CHUNK_ROWS) {
+    // full, move the upper half into a new chunk right after this one
+    int half = KILO_CHUNK_ROWS / 2;
+    chunk *n = chunkNew(0, KILO_CHUNK_ROWS - half);
+    n -> rows = malloc(sizeof(erow) * KILO_CHUNK_ROWS);
+    memcpy(n -> rows, &c -> rows[half], sizeof(erow) * n -> nrows);
+    n -> edited = 1;
+    coldWarm(n);
+    docAdjust(rank, -n -> nrows);
+    docInsertChunk(n, rank, c);
+    if (idx > half) {
+      c = n;
+      idx -= half;
+      rank++;
+    }
+  }
+  memmove(&c -> rows[idx + 1], &c -> rows[idx], sizeof(erow) * (c -> nrows - idx));
+  docAdjust(rank, 1);
+
+  erow *row = &c -> rows[idx];
+  row -> owned = 0;
+  row -> interned = 0;
+  row -> rdirty = 1;
+  row -> rc = NULL;
+  row -> rxi = NULL;
+  row -> utf8 = -1;
+  row -> hl_start = row -> hl_end = HLS_NORMAL;
+  row -> hl_stale = 1;
+
+  E.numrows++;
+  E.dirty++;
+  if (at + 1 < E.numrows) editorRowAt(at + 1) -> hl_stale = 1; // the row above it changed
+  return row;
+}
+
+void editorInsertRow(int at, char *s, size_t len)
+{
+  if (at < 0 || at > E.numrows) return;
+  erow *row = editorInsertRowSlot(at);
+  row -> size = len;
+  row -> cap = len + 1;
+  row -> gap = len;
+  row -> chars = malloc(row -> cap);
+  memcpy(row -> chars, s, len);
+  row -> owned = 1;
+  CS.row_bytes += row -> cap;
+}
+
+// a line read from the file, as the last row. With interning on, rows with
+// the same text share one copy of it
+void editorAppendLine(char *s, size_t len) {
+  if (!IT.on) {
+    editorInsertRow(E.numrows, s, len);
+    return;
+  }
+  erow *row = editorInsertRowSlot(E.numrows);
+  row -> chars = internGet(s, len);
+  row -> size = row -> cap = row -> gap = len;
+  row -> interned = 1;
+}
+
+erow *editorRowAt(int at) {
+  int idx, rank;
+  chunk *c = docLocate(at, &idx, &rank);
+  if (c -> rows == NULL) chunkLoad(c);
+  else CS.hits++;
+  coldTouch(c);
+  return &c -> rows[idx];
+}
+
+// like editorRowAt(), for a row that is about to be changed. The pointer is
+// only good until the next editorRowEdit() on another chunk
+erow *editorRowEdit(int at) {
+  int idx, rank;
+  chunk *c = docLocate(at, &idx, &rank);
+  if (c -> rows) CS.hits++;
+  chunkEdit(c);
+  coldTouch(c);
+  return &c -> rows[idx];
+}
+
+void editorFreeRow(erow *row) {
+  editorRowReleaseRender(row);
+  free(row -> rxi);
+  if (row -> owned) {
+    free(row -> chars);
+    CS.row_bytes -= row -> cap;
+  } else if (row -> interned) {
+    internPut(row -> chars);
+  }
+}
+
+void editorDelRow(int at) {
+  if (at < 0 || at >= E.numrows) return;
+  int idx, rank;
+  chunk *c = docLocate(at, &idx, &rank);
+  chunkEdit(c);
+  editorFreeRow(&c -> rows[idx]);
+  memmove(&c -> rows[idx], &c -> rows[idx + 1], sizeof(erow) * (c -> nrows - idx - 1));
+  if (c -> nrows == 1) docRemoveChunk(c, rank);
+  else docAdjust(rank, -1);
+  E.numrows--;
+  E.dirty++;
+  if (at < E.numrows) editorRowAt(at) -> hl_stale = 1; // the row above it changed
+}
+
+// rows borrowed from the mapping, or from an interned line, get their own
+// copy before the first edit
+void editorRowOwn(erow *row) {
+  if (row -> owned) return;
+  row -> cap = row -> size + 16;
+  char *chars = malloc(row -> cap);
+  memcpy(chars, row -> chars, row -> size);
+  if (row -> interned) internPut(row -> chars);
+  row -> interned = 0;
+  row -> chars = chars;
+  row -> gap = row -> size;
+  row -> owned = 1;
+  CS.row_bytes += row -> cap;
+}
+
+// only ever called on owned rows
+void editorRowMoveGap(erow *row, int at) {
+  int gaplen = row -> cap - row -> size;
+  if (at < row -> gap)
+    memmove(&row -> chars[at + gaplen], &row -> chars[at], row -> gap - at);
+  else if (at > row -> gap)
+    memmove(&row -> chars[row -> gap], &row -> chars[row -> gap + gaplen], at - row -> gap);
+  row -> gap = at;
+}
+
+// make room for len more bytes in the gap, doubling the buffer so that a run
+// of inserts only reallocates O(log n) times
+void editorRowReserve(erow *row, int len) {
+  if (row -> cap - row -> size >= len) return;
+  int cap = row -> cap * 2;
+  if (cap < row -> size + len) cap = row -> size + len;
+  if (cap < 16) cap = 16;
+  int tail = row -> size - row -> gap;
+  row -> chars = realloc(row -> chars, cap);
+  memmove(&row -> chars[cap - tail], &row -> chars[row -> cap - tail], tail);
+  CS.row_bytes += cap - row -> cap;
+  row -> cap = cap;
+}
+
+// contiguous bytes of the row from at to the end, moving the gap out of the way if needed
+char *editorRowTail(erow *row, int at) {
+  if (row -> owned && at < row -> gap) editorRowMoveGap(row, at);
+  return at < row -> gap ? &row -> chars[at] : &row -> chars[at + row -> cap - row -> size];
+}
+
+// the text changed from at onwards: the render and the checkpoints after at are stale
+void editorRowChanged(erow *row, int at) {
+  row -> rdirty = 1;
+  row -> hl_stale = 1;
+  at = at > 3 ? at - 3 : 0; // the character the edit cut into may start up to 3 bytes earlier
+  if (row -> rxi && row -> rxi -> valid > at / row -> rxi -> step + 1) row -> rxi -> valid = at / row -> rxi -> step + 1;
+}
+
+// drop everything from at onwards
+void editorRowTruncate(erow *row, int at) {
+  if (at > row -> gap) editorRowMoveGap(row, at); // borrowed rows never get here, their gap is at the end
+  row -> gap = at;
+  row -> size = at;
+  editorRowChanged(row, at);
+}
+
+void editorRowInsertChar(erow *row, int at, int c) {
+  if (at < 0 || at > row -> size) at = row -> size;
+  editorRowOwn(row);
+  editorRowReserve(row, 1);
+  editorRowMoveGap(row, at);
+  row -> chars[row -> gap++] = c;
+  row -> size++;
+  if ((c & 0x80) && row -> utf8 == 0) row -> utf8 = 1;
+  editorRowChanged(row, at);
+  E.dirty++;
+}
+
+void editorRowInsertString(erow *row, int at, const char *s, size_t len) {
+  if (at < 0 || at > row -> size) at = row -> size;
+  editorRowOwn(row);
+  editorRowReserve(row, len);
+  editorRowMoveGap(row, at);
+  memcpy(&row -> chars[row -> gap], s, len);
+  row -> gap += len;
+  row -> size += len;
+  if (row -> utf8 == 0 && !asciiOnly(s, len)) row -> utf8 = 1;
+  editorRowChanged(row, at);
+  E.dirty++;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+  editorRowInsertString(row, row -> size, s, len);
+}
+
+void editorRowDelChar(erow *row, int at) {
+  if (at < 0 || at >= row -> size) return;
+  editorRowOwn(row);
+  editorRowMoveGap(row, at);
+  row -> size--; // the gap grows over the deleted byte
+  editorRowChanged(row, at);
+  E.dirty++;
+}
+
+// move everything from col onwards in row at to a new row below it
+void editorSplitRow(int at, int col) {
+  erow *row = editorRowEdit(at);
+  editorInsertRow(at + 1, editorRowTail(row, col), row -> size - col);
+  editorRowTruncate(editorRowAt(at), col);
+}
+
+// append row at + 1 to row at
+void editorJoinRow(int at) {
+  erow *row = editorRowEdit(at);
+  erow *next = editorRowEdit(at + 1);
+  editorRowAppendString(row, editorRowTail(next, 0), next -> size);
+  editorDelRow(at + 1);
+}
+
+/*** syntax highlighting ***/
+// Rows are highlighted lazily, when they are drawn. Each row keeps the lexer
+// state it ended in (inside a block comment, or a string continued with a
+// backslash) and the one it started from, and the colors live next to the
+// render in its cache entry. An edit only marks the row stale. When a stale
+// row is highlighted again and its end state comes out different, the row
+// below is marked stale in turn, so the work goes down the file only as far
+// as the state change reaches, and only as fast as those rows get drawn.
+#define KILO_HL_SYNC 512 // stale rows above a drawn row that are lexed again, beyond that the state is assumed normal
+
+static int is_separator(int c) {
+  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];{}&|^!?:", c) != NULL;
+}
+
+// highlight s[0, len) into hl, starting in lexer state state. Returns the state at the end
+static int editorLex(const char *s, int len, unsigned char *hl, int state) {
+  struct editorSyntax *syn = E.syntax;
+  char **keywords = syn -> keywords;
+  const char *scs = syn -> singleline_comment_start;
+  const char *mcs = syn -> multiline_comment_start;
+  const char *mce = syn -> multiline_comment_end;
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+
+  int prev_sep = 1;
+  int in_string = state == HLS_DQUOTE ? '"' : state == HLS_SQUOTE ? '\'' : 0;
+  int in_comment = state == HLS_COMMENT;
+  int continued = 0; // the string runs on to the next line
+  int i = 0;
+  while (i < len) {
+    char c = s[i];
+    unsigned char prev_hl = i > 0 ? hl[i - 1] : HL_NORMAL;
+
+    if (scs_len && !in_string && !in_comment && strncmp(&s[i], scs, scs_len) == 0) {
+      memset(&hl[i], HL_COMMENT, len - i);
+      break;
+    }
+
+    if (mcs_len && mce_len && !in_string) {
+      if (in_comment) {
+        if (strncmp(&s[i], mce, mce_len) == 0) {
+          memset(&hl[i], HL_MLCOMMENT, mce_len);
+          i += mce_len;
+          in_comment = 0;
+          prev_sep = 1;
+        } else {
+          hl[i++] = HL_MLCOMMENT;
+        }
+        continue;
+      } else if (strncmp(&s[i], mcs, mcs_len) == 0) {
+        memset(&hl[i], HL_MLCOMMENT, mcs_len);
+        i += mcs_len;
+        in_comment = 1;
+        continue;
+      }
+    }
+
+    if (syn -> flags & HL_HIGHLIGHT_STRINGS) {
+      if (in_string) {
+        hl[i] = HL_STRING;
+        if (c == '\\' && i + 1 < len) {
+          hl[i + 1] = HL_STRING;
+          i += 2;
+          continue;
+        }
+        if (c == '\\') continued = 1;
+        if (c == in_string) in_string = 0;
+        i++;
+        prev_sep = 1;
+        continue;
+      } else if (c == '"' || c == '\'') {
+        in_string = c;
+        hl[i++] = HL_STRING;
+        continue;
+      }
+    }
+
+    if (syn -> flags & HL_HIGHLIGHT_NUMBERS) {
+      if ((isdigit((unsigned char)c) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER)) {
+        hl[i++] = HL_NUMBER;
+        prev_sep = 0;
+        continue;
+      }
+    }
+
+    if (prev_sep) {
+      int j;
+      for (j = 0; keywords[j]; j++) {
+        int klen = strlen(keywords[j]);
+        int kw2 = keywords[j][klen - 1] == '|';
+        if (kw2) klen--;
+        if (strncmp(&s[i], keywords[j], klen) == 0 && is_separator(s[i + klen])) {
+          memset(&hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+          i += klen;
+          break;
+        }
+      }
+      if (keywords[j] != NULL) {
+        prev_sep = 0;
+        continue;
+      }
+    }
+
+    hl[i] = HL_NORMAL;
+    prev_sep = is_separator(c);
+    i++;
+  }
+
+  if (in_comment) return HLS_COMMENT;
+  if (in_string && continued) return in_string == '"' ? HLS_DQUOTE : HLS_SQUOTE;
+  return HLS_NORMAL;
+}
+
+// lex row at from state, keeping the colors with its render. Returns its end state
+static int editorRowHighlight(int at, int state) {
+  erow *row = editorRowAt(at);
+  int end = state; // rows too long to be rendered whole are left plain, state passes through
+  if (row -> size <= KILO_LONG_ROW) {
+    rcache *rc = editorRowRender(row, 0, E.screencols);
+    if (rc -> hlcap < rc -> rsize + 1) {
+      free(rc -> hl);
+      rc -> hlcap = rc -> rcap;
+      rc -> hl = malloc(rc -> hlcap);
+    }
+    end = editorLex(rc -> render, rc -> rsize, rc -> hl, state);
+    rc -> hl_ok = 1;
+  }
+  row -> hl_start = state;
+  row -> hl_stale = 0;
+  if (row -> hl_end != end) {
+    row -> hl_end = end;
+    if (at + 1 < E.numrows) editorRowAt(at + 1) -> hl_stale = 1; // it starts from a different state now
+  }
+  return end;
+}
+
+// the lexer state row at starts in, lexing the stale rows above it again first
+static int editorHlStart(int at) {
+  int s = at;
+  while (s > 0 && at - s < KILO_HL_SYNC && editorRowAt(s - 1) -> hl_stale) s--;
+  int state = HLS_NORMAL;
+  if (s > 0 && !editorRowAt(s - 1) -> hl_stale) state = editorRowAt(s - 1) -> hl_end;
+  for (; s < at; s++) state = editorRowHighlight(s, state);
+  return state;
+}
+
+// the colors of row at, brought up to date. NULL if the row goes uncolored
+unsigned char *editorRowColors(int at) {
+  if (E.syntax == NULL) return NULL;
+  int state = editorHlStart(at);
+  erow *row = editorRowAt(at);
+  if (row -> size > KILO_LONG_ROW) return NULL;
+  rcache *rc = editorRowRender(row, 0, E.screencols);
+  if (row -> hl_stale || row -> hl_start != state || !rc -> hl_ok) editorRowHighlight(at, state);
+  return rc -> hl;
+}
+
+int editorSyntaxToColor(int hl) {
+  switch (hl) {
+    case HL_COMMENT:
+    case HL_MLCOMMENT: return 36; // cyan
+    case HL_KEYWORD1: return 33; // yellow
+    case HL_KEYWORD2: return 32; // green
+    case HL_STRING: return 35; // magenta
+    case HL_NUMBER: return 31; // red
+    default: return 39; // default foreground
+  }
+}
+
+// pick the syntax from the file name
+void editorSelectSyntaxHighlight() {
+  unsigned j;
+  E.syntax = NULL;
+  if (E.filename == NULL) return;
+  char *ext = strrchr(E.filename, '.');
+  for (j = 0; j < HLDB_ENTRIES && E.syntax == NULL; j++) {
+    struct editorSyntax *s = &HLDB[j];
+    int i;
+    for (i = 0; s -> filematch[i]; i++) {
+      int is_ext = s -> filematch[i][0] == '.';
+      if ((is_ext && ext && strcmp(ext, s -> filematch[i]) == 0) || (!is_ext && strstr(E.filename, s -> filematch[i]))) {
+        E.syntax = s;
+        break;
+      }
+    }
+  }
+}
+
+/*** undo ***/
+// Undo keeps a journal of small edit records rather than copies of rows:
+// text typed into or deleted from one row, a row split in two, two rows
+// joined, or a new empty row. Keystrokes that continue the previous record
+// (typing on at its end, backspacing from its start) extend it instead of
+// adding a new one, so memory grows with the text edited and undoing a record
+// costs time proportional to its size. Past KILO_UNDO_BYTES the oldest changes
+// are dropped.
+enum editType { EDIT_INSERT, EDIT_DELETE, EDIT_SPLIT, EDIT_JOIN, EDIT_ADDROW, EDIT_DELROW /* only in the edit journal */ };
+
+typedef struct undorec {
+  int type;
+  int row, col;
+  int len, cap;
+  char *text; // EDIT_INSERT: the text. EDIT_DELETE: the deleted bytes, last one first
+  int chain; // undone together with the record before it
+} undorec;
+
+struct undoJournal {
+  undorec *r;
+  int first; // oldest record kept
+  int pos; // records [first, pos) can be undone, [pos, n) redone
+  int n, cap;
+  long bytes;
+  int sealed; // don't extend the last record
+};
+
+struct undoJournal U = {NULL, 0, 0, 0, 0, 0, 0};
+
+static void undoFreeRec(undorec *r) {
+  U.bytes -= sizeof(undorec) + r -> cap;
+  free(r -> text);
+}
+
+static void undoAppendText(undorec *r, const char *s, int len) {
+  if (r -> len + len > r -> cap) {
+    int cap = r -> cap ? r -> cap * 2 : 16;
+    if (cap < r -> len + len) cap = r -> len + len;
+    r -> text = realloc(r -> text, cap);
+    U.bytes += cap - r -> cap;
+    r -> cap = cap;
+  }
+  memcpy(&r -> text[r -> len], s, len);
+  r -> len += len;
+}
+
+// keep the journal under its byte cap, oldest changes go first. Called as a
+// new change starts: a change goes whole, since undoing half of it would leave
+// half of it behind, so one still being added to (a paste) can't be trimmed.
+// The cap can be overshot by the newest change
+static void undoTrim() {
+  while (U.bytes > KILO_UNDO_BYTES) {
+    int end = U.first + 1;
+    while (end < U.pos && U.r[end].chain) end++;
+    if (end >= U.pos) break;
+    while (U.first < end) undoFreeRec(&U.r[U.first++]);
+  }
+  if (U.first > U.n / 2) {
+    memmove(U.r, &U.r[U.first], sizeof(undorec) * (U.n - U.first));
+    U.n -= U.first;
+    U.pos -= U.first;
+    U.first = 0;
+  }
+}
+
+// forget all history, the rows it refers to are gone
+void editorClearUndo() {
+  int j;
+  for (j = U.first; j < U.n; j++) undoFreeRec(&U.r[j]);
+  U.first = U.pos = U.n = 0;
+  U.sealed = 0;
+}
+
+// called by the editor operations for every change they make to the document
+void editorRecordEdit(int type, int row, int col, const char *s, int len, int chain) {
+  undorec *last = U.pos > U.first && !U.sealed ? &U.r[U.pos - 1] : NULL;
+  journalRecord(type, row, col, s, len);
+  while (U.n > U.pos) undoFreeRec(&U.r[--U.n]); // a new edit forgets what could be redone
+  U.sealed = 0;
+
+  if (last && type == EDIT_INSERT && last -> type == EDIT_INSERT &&
+      last -> row == row && last -> col + last -> len == col) {
+    undoAppendText(last, s, len);
+  } else if (last && type == EDIT_DELETE && last -> type == EDIT_DELETE &&
+      last -> row == row && col + len == last -> col) {
+    undoAppendText(last, s, len);
+    last -> col = col;
+  } else {
+    if (U.n == U.cap) {
+      U.cap = U.cap ? U.cap * 2 : 64;
+      U.r = realloc(U.r, sizeof(undorec) * U.cap);
+    }
+    undorec *r = &U.r[U.n++];
+    memset(r, 0, sizeof(undorec));
+    r -> type = type;
+    r -> row = row;
+    r -> col = col;
+    r -> chain = chain;
+    U.bytes += sizeof(undorec);
+    if (len) undoAppendText(r, s, len);
+    U.pos = U.n;
+    if (!chain) undoTrim(); // the change before this one is complete
+  }
+}
+
+// undo one record (dir -1) or redo it (dir 1), leaving the cursor where the
+// change happened. What it does goes into the edit journal like any other edit
+static void undoApply(undorec *r, int dir) {
+  erow *row = r -> type == EDIT_INSERT || r -> type == EDIT_DELETE ? editorRowEdit(r -> row) : NULL;
+  int j;
+  switch (r -> type) {
+    case EDIT_INSERT:
+    case EDIT_DELETE:
+      if ((r -> type == EDIT_INSERT) == (dir > 0)) {
+        if (r -> type == EDIT_INSERT) {
+          editorRowInsertString(row, r -> col, r -> text, r -> len);
+          journalRecord(EDIT_INSERT, r -> row, r -> col, r -> text, r -> len);
+        } else {
+          for (j = r -> len - 1; j >= 0; j--) {
+            editorRowInsertString(row, r -> col + r -> len - 1 - j, &r -> text[j], 1);
+            journalRecord(EDIT_INSERT, r -> row, r -> col + r -> len - 1 - j, &r -> text[j], 1);
+          }
+        }
+        E.cx = r -> col + r -> len;
+      } else {
+        for (j = 0; j < r -> len; j++) editorRowDelChar(row, r -> col);
+        journalRecord(EDIT_DELETE, r -> row, r -> col, NULL, r -> len);
+        E.cx = r -> col;
+      }
+      E.cy = r -> row;
+      break;
+    case EDIT_SPLIT:
+    case EDIT_JOIN:
+      if ((r -> type == EDIT_SPLIT) == (dir > 0)) {
+        editorSplitRow(r -> row, r -> col);
+        journalRecord(EDIT_SPLIT, r -> row, r -> col, NULL, 0);
+        E.cy = r -> row + 1;
+        E.cx = 0;
+      } else {
+        editorJoinRow(r -> row);
+        journalRecord(EDIT_JOIN, r -> row, r -> col, NULL, 0);
+        E.cy = r -> row;
+        E.cx = r -> col;
+      }
+      break;
+    case EDIT_ADDROW:
+      if (dir > 0) editorInsertRow(r -> row, "", 0);
+      else editorDelRow(r -> row);
+      journalRecord(dir > 0 ? EDIT_ADDROW : EDIT_DELROW, r -> row, 0, NULL, 0);
+      E.cy = r -> row;
+      E.cx = 0;
+      break;
+  }
+}
+
+void editorUndo() {
+  if (U.pos == U.first) {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+  do {
+    undoApply(&U.r[--U.pos], -1);
+  } while (U.r[U.pos].chain && U.pos > U.first);
+  U.sealed = 1;
+}
+
+void editorRedo() {
+  if (U.pos == U.n) {
+    editorSetStatusMessage("Nothing to redo");
+    return;
+  }
+  do {
+    undoApply(&U.r[U.pos++], 1);
+  } while (U.pos < U.n && U.r[U.pos].chain);
+  U.sealed = 1;
+}
+
+/*** editor operations ***/
+void editorInsertChar(int c) {
+  int chain = 0;
+  char ch = c;
+  if (E.cy == E.numrows) {
+    editorInsertRow(E.numrows, "", 0);
+    editorRecordEdit(EDIT_ADDROW, E.cy, 0, NULL, 0, 0);
+    chain = 1;
+  }
+  editorRowInsertChar(editorRowEdit(E.cy), E.cx, c);
+  editorRecordEdit(EDIT_INSERT, E.cy, E.cx, &ch, 1, chain);
+  E.cx++;
+}
+
+void editorInsertNewline() {
+  if (E.cx == 0) {
+    editorInsertRow(E.cy, "", 0);
+    editorRecordEdit(EDIT_ADDROW, E.cy, 0, NULL, 0, 0);
+  } else {
+    editorSplitRow(E.cy, E.cx);
+    editorRecordEdit(EDIT_SPLIT, E.cy, E.cx, NULL, 0, 0);
+  }
+  E.cy++;
+  E.cx = 0;
+}
+
+// insert a block of text at the cursor, as a single undo step. The first line
+// goes into the cursor's row, the row is split once, and every other line
+// becomes a new row of its own, so the rest of the row is only moved once
+void editorInsertText(const char *s, int len) {
+  const char *end = s + len, *p = s;
+  int chain = 0, split = 0;
+  U.sealed = 1;
+  if (E.cy == E.numrows) {
+    editorInsertRow(E.numrows, "", 0);
+    editorRecordEdit(EDIT_ADDROW, E.cy, 0, NULL, 0, 0);
+    chain = 1;
+  }
+  while (1) {
+    const char *nl = p;
+    while (nl < end && *nl != '\r' && *nl != '\n') nl++;
+    int n = nl - p;
+    if (split && nl < end) { // a whole line in the middle, it gets a row to itself
+      editorInsertRow(E.cy, (char *)p, n);
+      editorRecordEdit(EDIT_ADDROW, E.cy, 0, NULL, 0, chain);
+      editorRecordEdit(EDIT_INSERT, E.cy, 0, p, n, 1);
+      E.cy++;
+    } else if (n) { // the first line goes after the cursor, the last one before the rest of the row
+      editorRowInsertString(editorRowEdit(E.cy), E.cx, p, n);
+      editorRecordEdit(EDIT_INSERT, E.cy, E.cx, p, n, chain);
+      E.cx += n;
+    }
+    chain = 1;
+    if (nl == end) break;
+    p = nl + 1;
+    if (*nl == '\r' && p < end && *p == '\n') p++; // \r\n is one line break
+    if (!split) {
+      editorSplitRow(E.cy, E.cx);
+      editorRecordEdit(EDIT_SPLIT, E.cy, E.cx, NULL, 0, chain);
+      E.cy++;
+      E.cx = 0;
+      split = 1;
+    }
+  }
+  U.sealed = 1;
+}
+
+void editorDelChar() {
+  if (E.cy == E.numrows) return;
+  if (E.cx == 0 && E.cy == 0) return;
+
+  if (E.cx > 0) {
+    erow *row = editorRowEdit(E.cy);
+    int n = E.cx - editorRowCharStart(row, E.cx - 1); // all the bytes of the character
+    while (n--) {
+      char ch = editorRowChar(row, E.cx - 1);
+      editorRowDelChar(row, E.cx - 1);
+      E.cx--;
+      editorRecordEdit(EDIT_DELETE, E.cy, E.cx, &ch, 1, 0);
+    }
+  } else {
+    E.cx = editorRowAt(E.cy - 1) -> size;
+    editorJoinRow(E.cy - 1);
+    E.cy--;
+    editorRecordEdit(EDIT_JOIN, E.cy, E.cx, NULL, 0, 0);
+  }
+}
+
+/*** file i/o ***/
+void editorUnmapFile() {
+  if (E.map) munmap(E.map, E.maplen);
+  E.map = NULL;
+  E.maplen = 0;
+  free(E.lineoff);
+  E.lineoff = NULL;
+  E.nlines = 0;
+}
+
+// the file was cut down to keep bytes under the mapping, and the pages past
+// that fault when they're touched. Rows still borrowing from the mapping get
+// a copy of their own, empty for the lines that went with the cut, and the
+// mapping is let go. Returns how many lines were lost
+int editorDetachMap(off_t keep) {
+  chunk *c;
+  int j, lost = 0;
+  if (!E.map) return 0;
+  if (keep > (off_t)E.maplen) keep = E.maplen;
+  for (c = E.head; c; c = c -> next) {
+    if (c -> z) continue; // rows borrow from the block's text, if at all
+    if (c -> rows == NULL) { // chunkLoad() would read the line endings, which may be gone
+      erow *rows = malloc(sizeof(erow) * KILO_CHUNK_ROWS);
+      for (j = 0; j < c -> nrows; j++) {
+        int n = c -> first + j, len;
+        off_t end = n + 1 < E.nlines ? E.lineoff[n + 1] : (off_t)E.maplen;
+        if (end <= keep) {
+          const char *line = editorLineBytes(n, &len);
+          rowBorrow(&rows[j], (char *)line, len);
+        } else { // the loop below sees it's past the cut without reading it
+          rowBorrow(&rows[j], E.map + E.lineoff[n], end - E.lineoff[n]);
+        }
+      }
+      chunkWarm(c, rows);
+    }
+    for (j = 0; j < c -> nrows; j++) {
+      erow *row = &c -> rows[j];
+      if (row -> owned || row -> interned) continue;
+      int cut = row -> chars + row -> size > E.map + keep;
+      if (cut) row -> size = row -> gap = 0; // before editorRowOwn() reads them
+      editorRowOwn(row);
+      if (cut) {
+        editorRowChanged(row, 0);
+        lost++;
+      }
+    }
+    c -> edited = 1; // nothing to load it again from, coldEvict() has to compress it
+  }
+  editorUnmapFile();
+  coldTrim();
+  return lost;
+}
+
+// The line index of a mapped file is built by several threads, each scanning
+// its own piece of the mapping for newlines 64 bytes at a time and keeping
+// the line starts it finds in a list of its own. The lists are then copied
+// into one index, also in parallel, each at the offset the counts before it
+// add up to.
+#define KILO_LOAD_THREADS 64 // most threads a line index is built with
+#define KILO_LOAD_PIECE (8 << 20) // least bytes worth starting a thread for
+#define KILO_LOAD_RATE_MIN (64 << 20) // smaller files load too fast for their rate to say anything
+
+typedef struct linepiece {
+  const char *map;
+  size_t lo, hi; // bytes [lo, hi) of the mapping
+  size_t size; // of the whole mapping
+  off_t *off; // starts of the lines found, in order
+  size_t n, cap;
+  off_t *out; // where they go in the merged index
+} linepiece;
+
+static void linePieceGrow(linepiece *lp, size_t more) {
+  if (lp -> n + more <= lp -> cap) return;
+  lp -> cap = lp -> cap * 2 > lp -> n + more ? lp -> cap * 2 : lp -> n + more;
+  lp -> off = realloc(lp -> off, sizeof(off_t) * lp -> cap);
+}
+
+// the offset after every newline in [lo, hi), unless it's the end of the file
+static void *linePieceScan(void *arg) {
+  linepiece *lp = arg;
+  const char *map = lp -> map;
+  size_t i = lp -> lo;
+#if defined(__SSE2__)
+  const __m128i nl = _mm_set1_epi8('\n');
+  for (; i + 64 <= lp -> hi; i += 64) {
+    const __m128i *p = (const __m128i *)(map + i);
+    unsigned long long mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p), nl))
+      | (unsigned long long)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p + 1), nl)) << 16
+      | (unsigned long long)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p + 2), nl)) << 32
+      | (unsigned long long)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p + 3), nl)) << 48;
+    if (mask == 0) continue;
+    linePieceGrow(lp, 64);
+    while (mask) {
+      lp -> off[lp -> n++] = i + __builtin_ctzll(mask) + 1;
+      mask &= mask - 1;
+    }
+  }
+#endif
+  for (; i < lp -> hi; i++) {
+    if (map[i] != '\n') continue;
+    linePieceGrow(lp, 1);
+    lp -> off[lp -> n++] = i + 1;
+  }
+  if (lp -> n && lp -> off[lp -> n - 1] == (off_t)lp -> size) lp -> n--; // a final newline starts no line
+  return NULL;
+}
+
+static void *linePieceCopy(void *arg) {
+  linepiece *lp = arg;
+  if (lp -> n) memcpy(lp -> out, lp -> off, sizeof(off_t) * lp -> n);
+  free(lp -> off);
+  return NULL;
+}
+
+// fn on every piece, one thread each, the first piece on this thread
+static void lineRun(linepiece *lp, int n, void *(*fn)(void *)) {
+  pthread_t t[KILO_LOAD_THREADS];
+  int started[KILO_LOAD_THREADS];
+  int j;
+  for (j = 1; j < n; j++) started[j] = pthread_create(&t[j], NULL, fn, &lp[j]) == 0;
+  fn(&lp[0]);
+  for (j = 1; j < n; j++) {
+    if (started[j]) pthread_join(t[j], NULL);
+    else fn(&lp[j]); // no thread to be had
+  }
+}
+
+// threads to index size bytes with: one per KILO_LOAD_PIECE, at most one per CPU
+int lineThreads(size_t size) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t n = size / KILO_LOAD_PIECE + 1;
+  if (cpus < 1) cpus = 1;
+  if (n > (size_t)cpus) n = cpus;
+  return n > KILO_LOAD_THREADS ? KILO_LOAD_THREADS : n;
+}
+
+// the start of every line of map, found by nthreads threads. Returns the number of lines
+int lineIndex(const char *map, size_t size, int nthreads, off_t **lineoffp) {
+  linepiece lp[KILO_LOAD_THREADS];
+  int j;
+  size_t total = 1; // the first line starts at 0 without a newline before it
+  if (nthreads > KILO_LOAD_THREADS) nthreads = KILO_LOAD_THREADS;
+  if (nthreads < 1) nthreads = 1;
+  for (j = 0; j < nthreads; j++) {
+    lp[j].map = map;
+    lp[j].lo = size * j / nthreads;
+    lp[j].hi = size * (j + 1) / nthreads;
+    lp[j].size = size;
+    lp[j].off = NULL;
+    lp[j].n = lp[j].cap = 0;
+  }
+  lineRun(lp, nthreads, linePieceScan);
+
+  for (j = 0; j < nthreads; j++) total += lp[j].n;
+  off_t *lineoff = malloc(sizeof(off_t) * total);
+  lineoff[0] = 0;
+  total = 1;
+  for (j = 0; j < nthreads; j++) {
+    lp[j].out = &lineoff[total];
+    total += lp[j].n;
+  }
+  lineRun(lp, nthreads, linePieceCopy);
+  *lineoffp = lineoff;
+  return total;
+}
+
+// map fd and build the line-offset index over it. Returns the number of lines,
+// or -1 if the file can't be mapped (pipes, empty files, ...)
+int editorMapLines(int fd, char **mapp, size_t *maplenp, off_t **lineoffp) {
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) return -1;
+
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) return -1;
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  E.load_threads = lineThreads(st.st_size);
+  int n = lineIndex(map, st.st_size, E.load_threads, lineoffp);
+  madvise(map, st.st_size, MADV_RANDOM);
+
+  *mapp = map;
+  *maplenp = st.st_size;
+  return n;
+}
+
+// the whole file becomes a run of cold chunks, so opening it costs one memchr()
+// pass and no per-line allocation at all
+int editorMapFile(int fd) {
+  double t = benchNow();
+  int n = editorMapLines(fd, &E.map, &E.maplen, &E.lineoff);
+  if (n == -1) return -1;
+  E.nlines = n;
+  if (E.maplen >= KILO_LOAD_RATE_MIN) E.load_rate = E.maplen / (benchNow() - t) / 1e9;
+
+  int first;
+  for (first = 0; first < n; first += KILO_CHUNK_ROWS) {
+    chunk *c = chunkNew(first, n - first < KILO_CHUNK_ROWS ? n - first : KILO_CHUNK_ROWS);
+    c -> prev = E.tail;
+    if (E.tail) E.tail -> next = c;
+    else E.head = c;
+    E.tail = c;
+    E.root = treeMerge(E.root, c);
+  }
+  E.numrows = n;
+  return 0;
+}
+
+void editorOpen(char *filename) {
+  free(E.filename);
+  E.filename = strdup(filename);
+  E.load_rate = 0;
+  editorSelectSyntaxHighlight();
+
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) die("open");
+  struct stat st;
+  if (fstat(fd, &st) == 0) {
+    FW.ino = st.st_ino;
+    FW.dev = st.st_dev;
+  } else {
+    memset(&st, 0, sizeof(st));
+  }
+  FW.off = 0;
+  FW.partial = 0;
+  if (editorMapFile(fd) == 0) {
+    close(fd);
+    FW.off = E.maplen;
+    FW.partial = E.map[E.maplen - 1] != '\n';
+    E.dirty = 0;
+    journalRecover(&st);
+    return;
+  }
+
+  FILE *fp = fdopen(fd, "r");
+  if (!fp) die("fdopen");
+
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+
+  while ((linelen = getline(&line, &linecap, fp)) != -1)
+  {
+    FW.off += linelen;
+    FW.partial = line[linelen - 1] != '\n';
+    while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) linelen--;
+    editorAppendLine(line, linelen);
+    if (E.numrows % KILO_CHUNK_ROWS == 0) coldTrim(); // chunks filled so far can be compressed already
+  }
+  free(line);
+  fclose(fp);
+  E.dirty = 0;
+  journalRecover(&st);
+}
+
+// Saving streams the rows straight out of their storage: writev() is handed
+// batches of pointers into the mapping and the row buffers, so no copy of the
+// document is ever made. Unedited lines that sit next to each other in the
+// mapping are merged into one iovec, which turns a cold chunk into a single
+// piece. The data goes to a temporary file that is renamed over the original
+// once it's complete, so a failed save leaves the old file alone. The mapping
+// keeps the old file's pages alive after the rename, so rows that borrow from
+// it stay valid.
+#define KILO_SAVE_IOV 1024 // iovecs gathered per writev()
+
+struct saveWriter {
+  int fd;
+  struct iovec iov[KILO_SAVE_IOV];
+  int n;
+  long long bytes;
+  int failed;
+};
+
+static void saveFlush(struct saveWriter *w) {
+  struct iovec *iov = w -> iov;
+  int n = w -> n;
+  w -> n = 0;
+  while (n > 0 && !w -> failed) {
+    ssize_t r = writev(w -> fd, iov, n);
+    if (r == -1) {
+      if (errno != EINTR) w -> failed = 1;
+      continue;
+    }
+    w -> bytes += r;
+    __atomic_store_n(&SJ.bytes, w -> bytes, __ATOMIC_RELAXED);
+    if (SJ.total && w -> bytes * 100 / SJ.total != (w -> bytes - r) * 100 / SJ.total)
+      editorWake(); // another percent done, for the status bar
+    // a short write: skip what went out and go again with the rest
+    while (n > 0 && (size_t)r >= iov -> iov_len) {
+      r -= iov -> iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov -> iov_base = (char *)iov -> iov_base + r;
+      iov -> iov_len -= r;
+    }
+  }
+}
+
+static void saveAdd(struct saveWriter *w, const char *p, size_t len) {
+  if (len == 0) return;
+  if (w -> n) {
+    struct iovec *last = &w -> iov[w -> n - 1];
+    if ((const char *)last -> iov_base + last -> iov_len == p) {
+      last -> iov_len += len;
+      return;
+    }
+  }
+  if (w -> n == KILO_SAVE_IOV) saveFlush(w);
+  w -> iov[w -> n].iov_base = (void *)p;
+  w -> iov[w -> n].iov_len = len;
+  w -> n++;
+}
+
+static void saveDocument(struct saveWriter *w, snapchunk *chunks, int nchunks) {
+  int k, j, len;
+  for (k = 0; k < nchunks && !w -> failed; k++) {
+    snapchunk *c = &chunks[k];
+    if (c -> z) { // the block already holds the lines as they're written out
+      char *text = malloc(c -> z -> rawlen + 1);
+      lzDecompress(c -> z -> data, c -> z -> zlen, text, c -> z -> rawlen);
+      saveAdd(w, text, c -> z -> rawlen);
+      saveFlush(w);
+      free(text);
+      continue;
+    }
+    for (j = 0; j < c -> nrows; j++) {
+      const char *s;
+      if (c -> rows) {
+        erow *row = &c -> rows[j];
+        saveAdd(w, row -> chars, row -> gap);
+        s = &row -> chars[row -> gap + row -> cap - row -> size];
+        len = row -> size - row -> gap;
+      } else {
+        s = editorLineBytes(c -> first + j, &len);
+      }
+      // a line that's still in the mapping usually has its newline right after it
+      if (E.map && s >= E.map && s + len < E.map + E.maplen && s[len] == '\n') {
+        saveAdd(w, s, len + 1);
+      } else {
+        saveAdd(w, s, len);
+        saveAdd(w, "\n", 1);
+      }
+    }
+  }
+  saveFlush(w);
+}
+
+struct saveJob SJ;
+
+// runs on its own thread, only reads the snapshot and the mapping
+static void *saveWorker(void *arg) {
+  (void)arg;
+  // write next to the original, so the rename stays on one filesystem, and
+  // keep the original's permissions
+  struct stat st;
+  mode_t mode = stat(SJ.filename, &st) == 0 ? st.st_mode & 07777 : 0644;
+  size_t namelen = strlen(SJ.filename);
+  char *tmp = malloc(namelen + 8);
+  memcpy(tmp, SJ.filename, namelen);
+  memcpy(tmp + namelen, ".XXXXXX", 8);
+
+  SJ.failed = 1;
+  int fd = mkstemp(tmp);
+  if (fd != -1) {
+    struct saveWriter w;
+    w.fd = fd;
+    w.n = 0;
+    w.bytes = 0;
+    w.failed = 0;
+    saveDocument(&w, SJ.chunks, SJ.nchunks);
+    // fsync() before rename() so a crash can't leave the new name pointing at unwritten data
+    int ok = !w.failed && fchmod(fd, mode) != -1 && fsync(fd) != -1 && fstat(fd, &SJ.st) != -1;
+    if (close(fd) == -1) ok = 0;
+    if (ok && rename(tmp, SJ.filename) != -1) {
+      SJ.failed = 0;
+    } else {
+      SJ.err = errno;
+      unlink(tmp);
+    }
+  } else {
+    SJ.err = errno;
+  }
+  free(tmp);
+  __atomic_store_n(&SJ.done, 1, __ATOMIC_RELEASE);
+  editorWake();
+  return NULL;
+}
+
+// wrap up a save once the worker is done. Returns 1 if the status bar changed
+int savePoll(int wait) {
+  if (!SJ.active) return 0;
+  if (!wait && !__atomic_load_n(&SJ.done, __ATOMIC_ACQUIRE)) {
+    int pct = SJ.total ? __atomic_load_n(&SJ.bytes, __ATOMIC_RELAXED) * 100 / SJ.total : 0;
+    if (pct == SJ.shown) return 0;
+    SJ.shown = pct;
+    editorSetStatusMessage("Saving %s... %d%%", SJ.filename, pct);
+    return 1;
+  }
+  if (SJ.threaded) pthread_join(SJ.thread, NULL);
+
+  // the editor is the only owner of its rows again
+  int j, k;
+  chunk *c;
+  for (c = E.head; c; c = c -> next) c -> shared = 0;
+  for (k = 0; k < SJ.norphans; k++) {
+    for (j = 0; j < SJ.orphans[k].nrows; j++) {
+      erow *row = &SJ.orphans[k].rows[j];
+      if (row -> owned) {
+        free(row -> chars);
+        CS.row_bytes -= row -> cap;
+      } else if (row -> interned) {
+        internPut(row -> chars);
+      }
+    }
+    free(SJ.orphans[k].rows);
+    free(SJ.orphans[k].text);
+  }
+  SJ.norphans = 0;
+  for (k = 0; k < SJ.nchunks; k++) zblockPut(SJ.chunks[k].z);
+  free(SJ.chunks);
+  SJ.chunks = NULL;
+  SJ.active = 0;
+  journalSaved(!SJ.failed);
+
+  if (SJ.failed) {
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(SJ.err));
+  } else {
+    E.dirty -= SJ.dirty; // what's left was typed while the save was running
+    editorSetStatusMessage("%lld bytes written to disk", SJ.bytes);
+    followSaved(&SJ.st);
+  }
+  free(SJ.filename);
+  SJ.filename = NULL;
+  return 1;
+}
+
+void editorSave() {
+  if (SJ.active) {
+    editorSetStatusMessage("Still saving %s", SJ.filename);
+    return;
+  }
+  if (E.filename == NULL) {
+    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+    if (E.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntaxHighlight();
+  }
+
+  // the snapshot: one entry per chunk, and the chunks' rows arrays become shared
+  chunk *c;
+  int k = 0, j;
+  SJ.nchunks = treeChunks(E.root);
+  SJ.chunks = malloc(sizeof(snapchunk) * (SJ.nchunks ? SJ.nchunks : 1));
+  SJ.total = 0;
+  for (c = E.head; c; c = c -> next, k++) {
+    SJ.chunks[k].first = c -> first;
+    SJ.chunks[k].nrows = c -> nrows;
+    SJ.chunks[k].rows = c -> rows;
+    SJ.chunks[k].z = NULL;
+    if (c -> rows) {
+      c -> shared = 1;
+      for (j = 0; j < c -> nrows; j++) SJ.total += c -> rows[j].size + 1;
+    } else if (c -> z) {
+      SJ.chunks[k].z = c -> z;
+      c -> z -> refs++;
+      SJ.total += c -> z -> rawlen;
+    } else {
+      int last = c -> first + c -> nrows;
+      SJ.total += (last < E.nlines ? E.lineoff[last] : (off_t)E.maplen) - E.lineoff[c -> first];
+    }
+  }
+  SJ.filename = strdup(E.filename);
+  SJ.dirty = E.dirty;
+  SJ.bytes = 0;
+  SJ.shown = -1;
+  SJ.done = 0;
+  SJ.active = 1;
+  journalCut(); // edits from here on aren't in the snapshot
+  SJ.threaded = pthread_create(&SJ.thread, NULL, saveWorker, NULL) == 0;
+  if (!SJ.threaded) saveWorker(NULL); // no thread to be had, save the slow way
+  savePoll(0);
+}
+
+/*** journal ***/
+// Between saves every edit also goes into a journal next to the file
+// (.name.kj), so a crash doesn't take the unsaved changes with it. A record
+// is the edit type, then row, column and length as varints, the inserted
+// text, and a CRC-32 of it all. The journal starts with a header naming the
+// version of the file the records apply to. An edit that carries on from the
+// open record (typing on at its end, backspacing from its start) extends it,
+// so a keystroke costs a memcpy under a mutex and about a byte of journal. A
+// writer thread seals the open record and writes and fdatasync()s what piled
+// up every KILO_JOURNAL_SYNC ms; the editor never waits on the disk. A save
+// starts a new journal holding only the edits made after its snapshot, and
+// quitting removes it. editorOpen() replays a journal it finds, that's a
+// session that didn't get to quit.
+#define KILO_JOURNAL_SYNC 1000 // ms between writes of the journal, the most typing a crash can lose
+#define KILO_JOURNAL_MAGIC "kilojrn1"
+
+struct journalHeader {
+  char magic[8];
+  struct journalBase base;
+  unsigned crc; // of magic and base
+  unsigned unused;
+};
+
+struct journal J = {.type = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+static unsigned crcTable[256];
+
+static void crcInit() {
+  unsigned j, k;
+  for (j = 0; j < 256; j++) {
+    unsigned c = j;
+    for (k = 0; k < 8; k++) c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    crcTable[j] = c;
+  }
+}
+
+static unsigned crc32(unsigned crc, const void *p, int n) {
+  const unsigned char *s = p;
+  int j;
+  crc = ~crc;
+  for (j = 0; j < n; j++) crc = crcTable[(crc ^ s[j]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+static int varintPut(unsigned char *p, unsigned v) {
+  int n = 0;
+  while (v >= 0x80) {
+    p[n++] = v | 0x80;
+    v >>= 7;
+  }
+  p[n++] = v;
+  return n;
+}
+
+// bytes the varint at p takes, 0 if it's cut off or too long
+static int varintGet(const unsigned char *p, const unsigned char *end, unsigned *v) {
+  int n = 0;
+  *v = 0;
+  while (p + n < end && n < 5) {
+    *v |= (unsigned)(p[n] & 0x7f) << (7 * n);
+    if (!(p[n++] & 0x80)) return n;
+  }
+  return 0;
+}
+
+static void journalPut(char **b, int *len, int *cap, const void *p, int n) {
+  if (n == 0) return;
+  if (*len + n > *cap) {
+    *cap = *cap * 2 > *len + n ? *cap * 2 : *len + n + 256;
+    *b = realloc(*b, *cap);
+  }
+  memcpy(*b + *len, p, n);
+  *len += n;
+}
+
+static void journalBaseOf(struct journalBase *b, struct stat *st) {
+  b -> size = st -> st_size;
+  b -> mtime = st -> st_mtim.tv_sec;
+  b -> mtime_nsec = st -> st_mtim.tv_nsec;
+  b -> ino = st -> st_ino;
+}
+
+static void journalHeaderOf(struct journalHeader *h, struct journalBase *base) {
+  memset(h, 0, sizeof(*h));
+  memcpy(h -> magic, KILO_JOURNAL_MAGIC, 8);
+  h -> base = *base;
+  h -> crc = crc32(crc32(0, h -> magic, 8), &h -> base, sizeof(h -> base));
+}
+
+// .name.kj in the file's directory
+static char *journalPath(const char *filename) {
+  const char *name = strrchr(filename, '/');
+  name = name ? name + 1 : filename;
+  size_t size = strlen(filename) + 5;
+  char *path = malloc(size);
+  snprintf(path, size, "%.*s.%s.kj", (int)(name - filename), filename, name);
+  return path;
+}
+
+// encode the open record into buf, and into keep while a save is in flight.
+// Called with J.lock held
+static void journalSeal() {
+  if (J.type < 0) return;
+  unsigned char head[16], tail[4];
+  int n = 0, tlen = J.type == EDIT_INSERT ? J.len : 0;
+  head[n++] = J.type;
+  n += varintPut(&head[n], J.row);
+  n += varintPut(&head[n], J.col);
+  n += varintPut(&head[n], J.len);
+  unsigned crc = crc32(crc32(0, head, n), J.text, tlen);
+  tail[0] = crc;
+  tail[1] = crc >> 8;
+  tail[2] = crc >> 16;
+  tail[3] = crc >> 24;
+  if (J.on && !J.err) {
+    journalPut(&J.buf, &J.blen, &J.bcap, head, n);
+    journalPut(&J.buf, &J.blen, &J.bcap, J.text, tlen);
+    journalPut(&J.buf, &J.blen, &J.bcap, tail, 4);
+  }
+  if (J.keeping) {
+    journalPut(&J.keep, &J.klen, &J.kcap, head, n);
+    journalPut(&J.keep, &J.klen, &J.kcap, J.text, tlen);
+    journalPut(&J.keep, &J.klen, &J.kcap, tail, 4);
+  }
+  J.bytes += n + tlen + 4;
+  J.type = -1;
+}
+
+static int journalWrite(int fd, const char *p, int len) {
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// a new journal holding records for base: written to a temporary file that
+// is renamed over the old journal, so a crash while it's written leaves that
+// one. Returns the new journal's fd, or -1
+static int journalCreate(struct journalBase *base, const char *records, int len) {
+  struct journalHeader h;
+  size_t pathlen = strlen(J.path);
+  char *tmp = malloc(pathlen + 8);
+  memcpy(tmp, J.path, pathlen);
+  memcpy(tmp + pathlen, ".XXXXXX", 8);
+  int fd = mkstemp(tmp); // 0600, the journal holds what was typed
+  if (fd != -1) {
+    journalHeaderOf(&h, base);
+    if (journalWrite(fd, (char *)&h, sizeof(h)) == -1 || journalWrite(fd, records, len) == -1 ||
+        fdatasync(fd) == -1 || rename(tmp, J.path) == -1) {
+      int err = errno;
+      close(fd);
+      unlink(tmp);
+      errno = err;
+      fd = -1;
+    }
+  }
+  free(tmp);
+  return fd;
+}
+
+// put base in the header of the open journal, in place
+static int journalRewriteHeader(int fd, struct journalBase *base) {
+  struct journalHeader h;
+  journalHeaderOf(&h, base);
+  return pwrite(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) ? 0 : -1;
+}
+
+// carry on appending to the journal editorOpen() replayed, after its last good record
+static int journalReopen() {
+  int fd = open(J.path, O_WRONLY | O_CLOEXEC);
+  if (fd != -1 && (ftruncate(fd, J.recovered) == -1 || lseek(fd, 0, SEEK_END) == -1)) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    fd = -1;
+  }
+  return fd;
+}
+
+static void *journalWriter(void *arg) {
+  (void)arg;
+  char *out = NULL;
+  int olen, ocap = 0, fd;
+  pthread_mutex_lock(&J.lock);
+  struct journalBase base = J.base;
+  pthread_mutex_unlock(&J.lock);
+  fd = J.recovered ? journalReopen() : journalCreate(&base, NULL, 0);
+  int err = fd == -1 ? errno : 0;
+
+  pthread_mutex_lock(&J.lock);
+  J.err = err;
+  if (J.recovered) J.reheader = 1; // the base may have moved on since it was replayed
+  while (!J.stop && !J.err) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += KILO_JOURNAL_SYNC / 1000;
+    ts.tv_nsec += KILO_JOURNAL_SYNC % 1000 * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000L;
+    }
+    while (!J.stop && !J.rebase && pthread_cond_timedwait(&J.cond, &J.lock, &ts) != ETIMEDOUT);
+    if (J.stop) break;
+
+    journalSeal();
+    int rebase = J.rebase, reheader = J.reheader;
+    J.reheader = 0;
+    char *b = out;
+    int cap = ocap;
+    if (rebase) { // what came before the save's snapshot is in the file now, only keep is left
+      out = J.keep;
+      olen = J.klen;
+      ocap = J.kcap;
+      J.keep = b;
+      J.kcap = cap;
+      J.klen = J.blen = 0;
+      J.keeping = J.rebase = 0;
+      base = J.base;
+    } else {
+      out = J.buf;
+      olen = J.blen;
+      ocap = J.bcap;
+      J.buf = b;
+      J.bcap = cap;
+      J.blen = 0;
+      base = J.base;
+    }
+    pthread_mutex_unlock(&J.lock);
+
+    err = 0;
+    if (rebase) {
+      int nfd = journalCreate(&base, out, olen);
+      if (nfd == -1) {
+        err = errno;
+      } else {
+        close(fd);
+        fd = nfd;
+      }
+    } else if ((reheader && journalRewriteHeader(fd, &base) == -1) ||
+        (olen && journalWrite(fd, out, olen) == -1) || ((reheader || olen) && fdatasync(fd) == -1)) {
+      err = errno;
+    }
+    pthread_mutex_lock(&J.lock);
+    J.err = err;
+  }
+  pthread_mutex_unlock(&J.lock);
+  if (fd != -1) close(fd);
+  free(out);
+  return NULL;
+}
+
+// the first edit after the file was opened or saved starts the journal
+static int journalStart() {
+  if (E.filename == NULL) return -1;
+  if (J.path == NULL) J.path = journalPath(E.filename);
+  crcInit();
+  J.stop = J.err = J.warned = J.rebase = 0;
+  if (pthread_create(&J.thread, NULL, journalWriter, NULL) != 0) return -1;
+  J.on = J.owned = 1;
+  return 0;
+}
+
+// wait for a writer thread that stopped, or was told to
+static void journalJoin() {
+  pthread_mutex_lock(&J.lock);
+  J.stop = 1;
+  pthread_cond_signal(&J.cond);
+  pthread_mutex_unlock(&J.lock);
+  pthread_join(J.thread, NULL);
+  J.on = 0;
+}
+
+// called by editorRecordEdit() and undo for every change they make
+void journalRecord(int type, int row, int col, const char *s, int len) {
+  if (J.off == 2) return;
+  if (!J.on && !J.off && journalStart() == -1) J.off = 1;
+  if (J.off && !J.keeping) return;
+
+  pthread_mutex_lock(&J.lock);
+  int err = J.err, warned = J.warned;
+  if (err) J.warned = 1;
+  int extend = J.type == type && J.row == row &&
+      ((type == EDIT_INSERT && J.col + J.len == col) ||
+       (type == EDIT_DELETE && (col + len == J.col || col == J.col)));
+  if (!extend) {
+    journalSeal();
+    J.type = type;
+    J.row = row;
+    J.col = col;
+    J.len = 0;
+  } else if (type == EDIT_DELETE) {
+    J.col = col; // a backspace moves the start of the deleted bytes back
+  }
+  if (type == EDIT_INSERT) {
+    if (J.len + len > J.cap) {
+      J.cap = J.len + len > J.cap * 2 ? J.len + len : J.cap * 2;
+      J.text = realloc(J.text, J.cap);
+    }
+    memcpy(&J.text[J.len], s, len);
+  }
+  J.len += len;
+  J.records++;
+  pthread_mutex_unlock(&J.lock);
+
+  if (err && !warned)
+    editorSetStatusMessage("Can't write journal %s: %s. Save to keep your changes safe", J.path, strerror(err));
+}
+
+// a save took its snapshot: edits from now on are kept for the journal that
+// starts over once it's done
+void journalCut() {
+  pthread_mutex_lock(&J.lock);
+  journalSeal();
+  J.keeping = J.off != 2;
+  J.klen = 0;
+  pthread_mutex_unlock(&J.lock);
+}
+
+// the save is done. Its snapshot is in the file, so the journal only needs
+// what was typed since
+void journalSaved(int ok) {
+  struct stat st;
+  int stated = ok && stat(E.filename, &st) == 0;
+  pthread_mutex_lock(&J.lock);
+  journalSeal();
+  if (!ok || !stated || J.off == 2) {
+    J.keeping = 0;
+    J.klen = 0;
+    pthread_mutex_unlock(&J.lock);
+    return;
+  }
+  journalBaseOf(&J.base, &st);
+  J.recovered = 0;
+  if (J.on && !J.err) {
+    J.rebase = 1;
+    pthread_cond_signal(&J.cond);
+    pthread_mutex_unlock(&J.lock);
+    return;
+  }
+  pthread_mutex_unlock(&J.lock);
+
+  // it wasn't running, or gave up: start a new one with the edits since the snapshot
+  if (J.on) journalJoin();
+  if (J.owned) unlink(J.path); // a replayed journal that's all been saved
+  J.owned = 0;
+  J.off = 0;
+  char *b = J.buf;
+  int cap = J.bcap;
+  J.buf = J.keep;
+  J.blen = J.klen;
+  J.bcap = J.kcap;
+  J.keep = b;
+  J.kcap = cap;
+  J.klen = 0;
+  J.keeping = 0;
+  if (J.blen && journalStart() == -1) J.off = 1;
+}
+
+// follow mode loaded the file up to st -> st_size. The rows it appended
+// aren't journaled, they're in the file, so the records now apply to the file
+// as it is and a crash can still replay them
+void journalFollowed(struct stat *st) {
+  pthread_mutex_lock(&J.lock);
+  journalBaseOf(&J.base, st);
+  if (J.on) J.reheader = 1;
+  pthread_mutex_unlock(&J.lock);
+}
+
+// stop journaling and remove the journal, the edits were saved or thrown away
+void journalClose() {
+  if (J.on) journalJoin();
+  if (J.owned) unlink(J.path);
+  J.owned = 0;
+  J.recovered = 0;
+  J.type = -1;
+  J.blen = J.klen = 0;
+  J.keeping = 0;
+  if (J.off == 1) J.off = 0;
+}
+
+// apply one record, checking it fits the document. Returns -1 if it doesn't
+static int journalApply(int type, unsigned row, unsigned col, const char *s, unsigned len) {
+  if (row > (unsigned)E.numrows) return -1;
+  if (type == EDIT_ADDROW) {
+    editorInsertRow(row, "", 0);
+    return 0;
+  }
+  if (row == (unsigned)E.numrows) return -1;
+  unsigned size = editorRowAt(row) -> size;
+  unsigned j;
+  switch (type) {
+    case EDIT_INSERT:
+      if (col > size || len > INT_MAX - size) return -1;
+      editorRowInsertString(editorRowEdit(row), col, s, len);
+      return 0;
+    case EDIT_DELETE:
+      if (col > size || len > size - col) return -1;
+      for (j = 0; j < len; j++) editorRowDelChar(editorRowEdit(row), col);
+      return 0;
+    case EDIT_SPLIT:
+      if (col > size) return -1;
+      editorSplitRow(row, col);
+      return 0;
+    case EDIT_JOIN:
+      if (row + 1 >= (unsigned)E.numrows) return -1;
+      editorJoinRow(row);
+      return 0;
+    case EDIT_DELROW:
+      editorDelRow(row);
+      return 0;
+  }
+  return -1;
+}
+
+// editorOpen() loaded the file described by st. A journal for it means the
+// last session ended without saving or quitting: its edits are replayed
+void journalRecover(struct stat *st) {
+  struct journalHeader h;
+  journalBaseOf(&J.base, st);
+  if (J.on || J.owned) return;
+  crcInit();
+  free(J.path);
+  J.path = journalPath(E.filename);
+  J.off = 0;
+
+  int fd = open(J.path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return;
+  struct stat jst;
+  char *data = NULL;
+  ssize_t size = 0, n = 0;
+  if (fstat(fd, &jst) == 0 && jst.st_size >= (off_t)sizeof(h) && jst.st_size < INT_MAX) {
+    data = malloc(jst.st_size);
+    while (size < jst.st_size && (n = read(fd, data + size, jst.st_size - size)) > 0) size += n;
+  }
+  close(fd);
+  if (data == NULL || size < (ssize_t)sizeof(h)) {
+    free(data);
+    return;
+  }
+
+  struct journalHeader want;
+  memcpy(&h, data, sizeof(h));
+  journalHeaderOf(&want, &h.base);
+  if (memcmp(&h, &want, sizeof(h)) != 0 || size == sizeof(h)) { // not a journal, or nothing in it
+    free(data);
+    return;
+  }
+  if (memcmp(&h.base, &J.base, sizeof(h.base)) != 0) {
+    editorSetStatusMessage("%s has changed since %s was written, not replaying it", E.filename, J.path);
+    J.off = 2;
+    free(data);
+    return;
+  }
+
+  const unsigned char *p = (unsigned char *)data + sizeof(h), *end = (unsigned char *)data + size;
+  int records = 0;
+  while (p < end) {
+    unsigned row, col, len, crc;
+    int used = 1, k;
+    if ((k = varintGet(p + used, end, &row)) == 0) break;
+    used += k;
+    if ((k = varintGet(p + used, end, &col)) == 0) break;
+    used += k;
+    if ((k = varintGet(p + used, end, &len)) == 0) break;
+    used += k;
+    long long tlen = p[0] == EDIT_INSERT ? len : 0;
+    if (end - p < used + tlen + 4) break;
+    const unsigned char *tail = p + used + tlen;
+    crc = tail[0] | tail[1] << 8 | tail[2] << 16 | (unsigned)tail[3] << 24;
+    if (crc != crc32(0, p, used + tlen)) break;
+    if (journalApply(p[0], row, col, (const char *)p + used, len) == -1) break;
+    p = tail + 4;
+    records++;
+  }
+  J.recovered = p - (unsigned char *)data;
+  J.owned = 1;
+  if (p < end)
+    editorSetStatusMessage("Recovered %d edits from %s, the rest of it is damaged", records, J.path);
+  else
+    editorSetStatusMessage("Recovered %d unsaved edits from %s", records, J.path);
+  free(data);
+}
+
+/*** follow ***/
+// Follow mode (Ctrl-W, or kilo --follow FILE) is for logs that are still being
+// written to. inotify watches the file, and its directory for a new file
+// taking its name. Bytes appended since the last look are read with pread()
+// and become rows at the end of the document; nothing before them is looked
+// at again. A file that shrank, or whose name now points to another inode
+// (it was rotated), is loaded again from scratch.
+#define KILO_FOLLOW_READ (1 << 20) // bytes read per pread() while catching up
+
+struct follow FW = {0, -1, -1, -1, -1, 0, 0, 0, 0, 0};
+
+void followStop() {
+  if (FW.fd != -1) close(FW.fd);
+  if (FW.ifd != -1) close(FW.ifd); // takes the watches with it
+  FW.fd = FW.ifd = FW.wd = FW.dwd = -1;
+  FW.on = FW.pending = 0;
+}
+
+// open the file again to read appends from, and put the watches on it
+static int followAttach() {
+  char dir[PATH_MAX];
+  char *slash = strrchr(E.filename, '/');
+  if (slash == NULL) snprintf(dir, sizeof(dir), ".");
+  else snprintf(dir, sizeof(dir), "%.*s", slash == E.filename ? 1 : (int)(slash - E.filename), E.filename);
+
+  FW.fd = open(E.filename, O_RDONLY | O_CLOEXEC);
+  FW.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (FW.fd == -1 || FW.ifd == -1) return -1;
+  FW.wd = inotify_add_watch(FW.ifd, E.filename, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+  FW.dwd = inotify_add_watch(FW.ifd, dir, IN_CREATE | IN_MOVED_TO);
+  return FW.wd == -1 ? -1 : 0;
+}
+
+// put the cursor back on the last line if it was there before rows were added
+static void followPin(int pinned, int oldrows, int oldcy) {
+  if (!pinned) return;
+  E.cy = oldcy == oldrows ? E.numrows : E.numrows - 1;
+  if (E.cy < 0) E.cy = 0;
+  if (E.cy != oldcy) E.cx = 0;
+}
+
+// read the bytes from FW.off up to size and append them as rows
+static void followAppend(off_t size) {
+  int dirty = E.dirty, oldrows = E.numrows, oldcy = E.cy;
+  int pinned = E.cy >= E.numrows - 1;
+  char *buf = malloc(KILO_FOLLOW_READ);
+  while (FW.off < size) {
+    size_t want = size - FW.off < KILO_FOLLOW_READ ? (size_t)(size - FW.off) : KILO_FOLLOW_READ;
+    ssize_t n = pread(FW.fd, buf, want, FW.off);
+    if (n <= 0) break;
+    FW.off += n;
+    char *p = buf, *end = buf + n;
+    while (p < end) {
+      char *nl = memchr(p, '\n', end - p);
+      char *stop = nl ? nl : end;
+      if (!FW.partial) { // a line of its own, drop a CR that came with a CRLF before it's looked up
+        editorAppendLine(p, stop - p - (nl && stop > p && stop[-1] == '\r'));
+      } else {
+        editorRowAppendString(editorRowEdit(E.numrows - 1), p, stop - p);
+        if (nl) { // the line is complete, drop a CR that came with a CRLF
+          erow *row = editorRowAt(E.numrows - 1);
+          if (row -> size && editorRowChar(row, row -> size - 1) == '\r')
+            editorRowTruncate(editorRowEdit(E.numrows - 1), row -> size - 1);
+        }
+      }
+      FW.partial = nl == NULL;
+      p = nl ? nl + 1 : end;
+    }
+    coldTrim(); // a long catch-up stays within the budget too
+  }
+  free(buf);
+  E.dirty = dirty; // what came from the file isn't an unsaved change
+  followPin(pinned, oldrows, oldcy);
+}
+
+// load the file again after it was truncated to size, or rotated (size is -1).
+// Returns 1 (redraw)
+static int followReload(const char *why, off_t size) {
+  savePoll(1); // a save in flight still needs the rows, and settles E.dirty
+  if (E.dirty) {
+    int lost = size == -1 ? 0 : editorDetachMap(size);
+    if (lost)
+      editorSetStatusMessage("%s was %s, %d lines past its new end are lost. Stopped following", E.filename, why, lost);
+    else
+      editorSetStatusMessage("%s was %s, not reloading over unsaved changes. Stopped following", E.filename, why);
+    followStop();
+    return 1;
+  }
+  int oldrows = E.numrows, oldcy = E.cy;
+  int pinned = E.cy >= E.numrows - 1;
+  char *filename = strdup(E.filename);
+  followStop();
+  editorClearUndo();
+  journalClose();
+  editorFreeDoc();
+  editorUnmapFile();
+  editorOpen(filename);
+  free(filename);
+  if (followAttach() == -1) {
+    editorSetStatusMessage("Can't follow %s: %s", E.filename, strerror(errno));
+    followStop();
+  } else {
+    FW.on = 1;
+    editorSetStatusMessage("%s was %s, reloaded", E.filename, why);
+  }
+  if (E.cy > E.numrows) E.cy = E.numrows;
+  E.rowoff = 0; // editorScroll() brings the cursor back into view from the top
+  followPin(pinned, oldrows, oldcy);
+  if (E.cy < E.numrows && E.cx > editorRowAt(E.cy) -> size) E.cx = editorRowAt(E.cy) -> size;
+  return 1;
+}
+
+// the save renamed a new file over the old one. It holds the document as it
+// was saved, so that's where appends continue from, instead of it passing for
+// a rotated file that has to be loaded again
+void followSaved(struct stat *st) {
+  FW.ino = st -> st_ino;
+  FW.dev = st -> st_dev;
+  FW.off = st -> st_size;
+  FW.partial = 0; // every saved row ends in a newline
+  if (!FW.on) return;
+  inotify_rm_watch(FW.ifd, FW.wd);
+  close(FW.fd);
+  FW.fd = open(E.filename, O_RDONLY | O_CLOEXEC);
+  FW.wd = inotify_add_watch(FW.ifd, E.filename, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+  if (FW.fd == -1 || FW.wd == -1) {
+    editorSetStatusMessage("Can't follow %s: %s", E.filename, strerror(errno));
+    followStop();
+  }
+}
+
+// look at the file. Returns 1 if the document changed
+static int followCheck() {
+  struct stat st;
+  FW.pending = 0;
+  if (SJ.active) { // the save's own rename, look once followSaved() has seen it
+    FW.pending = 1;
+    return 0;
+  }
+  if (stat(E.filename, &st) == -1) return 0; // rotated away and the new file isn't there yet
+  if (st.st_ino != FW.ino || st.st_dev != FW.dev) return followReload("replaced", -1);
+  if (fstat(FW.fd, &st) == -1) return 0;
+  if (st.st_size < FW.off) return followReload("truncated", st.st_size);
+  if (st.st_size == FW.off) return 0;
+  followAppend(st.st_size);
+  st.st_size = FW.off; // what the rows hold, should a read have come up short
+  journalFollowed(&st);
+  return 1;
+}
+
+// the watches fired, or a check was put off. Returns 1 if the screen needs to be redrawn
+int followPoll() {
+  char buf[4096];
+  if (!FW.on) return 0;
+  while (read(FW.ifd, buf, sizeof(buf)) > 0); // what happened doesn't matter, followCheck() looks
+  if (E.prompting) { // search workers may be reading the document
+    FW.pending = 1;
+    return 0;
+  }
+  return followCheck();
+}
+
+void followToggle() {
+  if (FW.on) {
+    followStop();
+    editorSetStatusMessage("Stopped following");
+    return;
+  }
+  if (E.filename == NULL) {
+    editorSetStatusMessage("No file to follow");
+    return;
+  }
+  if (followAttach() == -1) {
+    editorSetStatusMessage("Can't follow %s: %s", E.filename, strerror(errno));
+    followStop();
+    return;
+  }
+  FW.on = 1;
+  editorSetStatusMessage("Following %s, Ctrl-W stops", E.filename);
+  followCheck(); // whatever was written since it was opened
+}
+
+/*** search engine ***/
+#define KILO_SEARCH_SHORT 32 // needles longer than this use Two-Way instead of the vector filter
+
+// A compiled query. Short needles are found by comparing the first and last
+// byte of the needle against 16 or 32 haystack positions at a time and only
+// checking the middle where both match. Long needles use the Two-Way algorithm,
+// which never backs up in the haystack. With icase, needle is stored lower
+// cased and every haystack byte is looked up in fold before comparing.
+typedef struct searcher {
+  unsigned char *needle;
+  long n;
+  int icase;
+  const unsigned char *fold;
+  unsigned char first[2], last[2]; // both cases of the first and last byte
+  long ms, p, mem0; // Two-Way critical factorization and period
+} searcher;
+
+static unsigned char fold_none[256], fold_lower[256];
+
+static void searchTwoWayCompile(searcher *s) {
+  const unsigned char *x = s -> needle;
+  long m = s -> n, ip, jp, k, p, p0, ms;
+
+  // maximal suffix for < and then for >, the longer one gives the factorization
+  ip = -1; jp = 0; k = p = 1;
+  while (jp + k < m) {
+    if (x[ip + k] == x[jp + k]) {
+      if (k == p) { jp += p; k = 1; } else k++;
+    } else if (x[ip + k] > x[jp + k]) {
+      jp += k; k = 1; p = jp - ip;
+    } else {
+      ip = jp++; k = p = 1;
+    }
+  }
+  ms = ip;
+  p0 = p;
+
+  ip = -1; jp = 0; k = p = 1;
+  while (jp + k < m) {
+    if (x[ip + k] == x[jp + k]) {
+      if (k == p) { jp += p; k = 1; } else k++;
+    } else if (x[ip + k] < x[jp + k]) {
+      jp += k; k = 1; p = jp - ip;
+    } else {
+      ip = jp++; k = p = 1;
+    }
+  }
+  if (ip + 1 > ms + 1) ms = ip;
+  else p = p0;
+
+  if (memcmp(x, x + p, ms + 1) != 0) {
+    // not periodic, shift by more than either half and don't remember anything
+    s -> mem0 = 0;
+    p = (ms > m - ms - 1 ? ms : m - ms - 1) + 1;
+  } else {
+    s -> mem0 = m - p;
+  }
+  s -> ms = ms;
+  s -> p = p;
+}
+
+void searchCompile(searcher *s, const char *needle, int icase) {
+  static int folds_ready = 0;
+  int j;
+  if (!folds_ready) {
+    for (j = 0; j < 256; j++) {
+      fold_none[j] = j;
+      fold_lower[j] = tolower(j);
+    }
+    folds_ready = 1;
+  }
+
+  free(s -> needle);
+  s -> n = strlen(needle);
+  s -> icase = icase;
+  s -> fold = icase ? fold_lower : fold_none;
+  s -> needle = malloc(s -> n + 1);
+  for (j = 0; j < s -> n; j++) s -> needle[j] = s -> fold[(unsigned char)needle[j]];
+  if (s -> n == 0) return;
+
+  unsigned char f = s -> needle[0], l = s -> needle[s -> n - 1];
+  s -> first[0] = f;
+  s -> first[1] = icase ? toupper(f) : f;
+  s -> last[0] = l;
+  s -> last[1] = icase ? toupper(l) : l;
+  if (s -> n > KILO_SEARCH_SHORT) searchTwoWayCompile(s);
+}
+
+void searchFree(searcher *s) {
+  free(s -> needle);
+  s -> needle = NULL;
+}
+
+// does the needle's middle match at h (first and last byte already do)?
+static inline int searchMiddle(const searcher *s, const unsigned char *h) {
+  long j;
+  if (!s -> icase) return memcmp(h + 1, s -> needle + 1, s -> n - 2) == 0;
+  for (j = 1; j < s -> n - 1; j++)
+    if (fold_lower[h[j]] != s -> needle[j]) return 0;
+  return 1;
+}
+
+static long searchScalar(const searcher *s, const unsigned char *h, long len, long i) {
+  long n = s -> n;
+  for (; i + n <= len; i++) {
+    if (!s -> icase) {
+      const unsigned char *f = memchr(h + i, s -> first[0], len - n + 1 - i);
+      if (!f) return -1;
+      i = f - h;
+    } else if (fold_lower[h[i]] != s -> first[0]) {
+      continue;
+    }
+    if (s -> fold[h[i + n - 1]] == s -> last[0] && (n < 2 || searchMiddle(s, h + i))) return i;
+  }
+  return -1;
+}
+
+#if defined(__SSE2__)
+static long searchSSE2(const searcher *s, const unsigned char *h, long len) {
+  long n = s -> n, i = 0;
+  __m128i f0 = _mm_set1_epi8(s -> first[0]), f1 = _mm_set1_epi8(s -> first[1]);
+  __m128i l0 = _mm_set1_epi8(s -> last[0]), l1 = _mm_set1_epi8(s -> last[1]);
+  for (; i + n - 1 + 16 <= len; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(h + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(h + i + n - 1));
+    __m128i ma = _mm_or_si128(_mm_cmpeq_epi8(a, f0), _mm_cmpeq_epi8(a, f1));
+    __m128i mb = _mm_or_si128(_mm_cmpeq_epi8(b, l0), _mm_cmpeq_epi8(b, l1));
+    unsigned mask = _mm_movemask_epi8(_mm_and_si128(ma, mb));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (n < 3 || searchMiddle(s, h + i + bit)) return i + bit;
+      mask &= mask - 1;
+    }
+  }
+  return searchScalar(s, h, len, i);
+}
+#endif
+
+#if KILO_HAVE_AVX2
+__attribute__((target("avx2")))
+static long searchAVX2(const searcher *s, const unsigned char *h, long len) {
+  long n = s -> n, i = 0;
+  __m256i f0 = _mm256_set1_epi8(s -> first[0]), f1 = _mm256_set1_epi8(s -> first[1]);
+  __m256i l0 = _mm256_set1_epi8(s -> last[0]), l1 = _mm256_set1_epi8(s -> last[1]);
+  for (; i + n - 1 + 32 <= len; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(h + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(h + i + n - 1));
+    __m256i ma = _mm256_or_si256(_mm256_cmpeq_epi8(a, f0), _mm256_cmpeq_epi8(a, f1));
+    __m256i mb = _mm256_or_si256(_mm256_cmpeq_epi8(b, l0), _mm256_cmpeq_epi8(b, l1));
+    unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(ma, mb));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (n < 3 || searchMiddle(s, h + i + bit)) return i + bit;
+      mask &= mask - 1;
+    }
+  }
+  return searchScalar(s, h, len, i);
+}
+#endif
+
+static long searchTwoWay(const searcher *s, const unsigned char *h, long len) {
+  const unsigned char *x = s -> needle, *fold = s -> fold;
+  long m = s -> n, ms = s -> ms, p = s -> p, mem = 0, pos = 0, k;
+  while (pos + m <= len) {
+    // right half first, then the left half
+    for (k = (ms + 1 > mem ? ms + 1 : mem); k < m && x[k] == fold[h[pos + k]]; k++);
+    if (k < m) {
+      pos += k - ms;
+      mem = 0;
+      continue;
+    }
+    for (k = ms + 1; k > mem && x[k - 1] == fold[h[pos + k - 1]]; k--);
+    if (k <= mem) return pos;
+    pos += p;
+    mem = s -> mem0;
+  }
+  return -1;
+}
+
+// offset of the first match of s in hay, or -1
+long searchFind(const searcher *s, const char *hay, long len) {
+  const unsigned char *h = (const unsigned char *)hay;
+  if (s -> n == 0) return 0;
+  if (s -> n > len) return -1;
+  if (s -> n > KILO_SEARCH_SHORT) return searchTwoWay(s, h, len);
+#if KILO_HAVE_AVX2
+  static int avx2 = -1;
+  if (avx2 == -1) avx2 = __builtin_cpu_supports("avx2");
+  if (avx2) return searchAVX2(s, h, len);
+#endif
+#if defined(__SSE2__)
+  return searchSSE2(s, h, len);
+#else
+  return searchScalar(s, h, len, 0);
+#endif
+}
+
+// first match in a row at or after from, as a cx. Owned rows are searched on
+// both sides of the gap, plus a small window across it for matches that
+// straddle the gap. Only reads the row, so it is safe from the search workers.
+long searchRow(const searcher *s, erow *row, long from) {
+  long off, gap = row -> gap;
+  if (from < gap) {
+    off = searchFind(s, row -> chars + from, gap - from);
+    if (off != -1) return from + off;
+  }
+  if (gap == row -> size) return -1;
+
+  const char *tail = &row -> chars[gap + row -> cap - row -> size];
+  long taillen = row -> size - gap;
+  if (s -> n > 1 && from < gap) {
+    long before = s -> n - 1 < gap - from ? s -> n - 1 : gap - from;
+    long after = s -> n - 1 < taillen ? s -> n - 1 : taillen;
+    char stackbuf[2 * KILO_SEARCH_SHORT];
+    char *win = before + after <= (long)sizeof(stackbuf) ? stackbuf : malloc(before + after);
+    memcpy(win, &row -> chars[gap - before], before);
+    memcpy(win + before, tail, after);
+    off = searchFind(s, win, before + after);
+    if (win != stackbuf) free(win);
+    if (off != -1) return gap - before + off;
+  }
+  long skip = from > gap ? from - gap : 0;
+  off = searchFind(s, tail + skip, taillen - skip);
+  return off == -1 ? -1 : gap + skip + off;
+}
+
+/*** regex ***/
+// A small regex engine: literals, ., [classes], \d \w \s (and \D \W \S), * + ?,
+// |, (groups), ^ and $. Patterns are parsed into a tree and compiled twice into
+// Thompson NFAs, once forwards and once backwards. Matching runs on DFAs built
+// lazily from those NFAs (each DFA state is a set of NFA states, and a
+// transition is only worked out the first time it's taken), so every byte costs
+// one table lookup and nothing ever backtracks.
+//
+// A line is matched by running the reversed pattern from the end of the line
+// towards the start, which finds the leftmost position where a match begins,
+// then the forward pattern from there to find where that match ends.
+#define KILO_DFA_STATES 2048 // cached DFA states before the cache is thrown away
+#define KILO_DFA_HASH 4096
+#define KILO_RX_POLL 65536 // bytes scanned in a line between checks for cancel
+
+enum rxType { RX_CLASS, RX_CAT, RX_ALT, RX_STAR, RX_PLUS, RX_QUEST, RX_BOL, RX_EOL, RX_EMPTY };
+
+typedef struct rxnode {
+  int type;
+  struct rxnode *a, *b;
+  unsigned char cls[32]; // RX_CLASS: bitmap of the bytes it matches
+} rxnode;
+
+typedef struct rxparser {
+  const char *p;
+  int icase;
+  const char *err;
+} rxparser;
+
+static rxnode *rxNode(int type, rxnode *a, rxnode *b) {
+  rxnode *n = calloc(1, sizeof(rxnode));
+  n -> type = type;
+  n -> a = a;
+  n -> b = b;
+  return n;
+}
+
+static void rxFreeNode(rxnode *n) {
+  if (!n) return;
+  rxFreeNode(n -> a);
+  rxFreeNode(n -> b);
+  free(n);
+}
+
+static void clsAdd(unsigned char *cls, int c, int icase) {
+  cls[c >> 3] |= 1 << (c & 7);
+  if (icase) {
+    cls[tolower(c) >> 3] |= 1 << (tolower(c) & 7);
+    cls[toupper(c) >> 3] |= 1 << (toupper(c) & 7);
+  }
+}
+
+static inline int clsHas(const unsigned char *cls, int c) {
+  return cls[c >> 3] & (1 << (c & 7));
+}
+
+// \d, \w, \s and their negations; returns 0 if c isn't one of those
+static int rxEscapeClass(unsigned char *cls, int c) {
+  unsigned char tmp[32];
+  int j;
+  memset(tmp, 0, sizeof(tmp));
+  switch (tolower(c)) {
+    case 'd': for (j = '0'; j <= '9'; j++) clsAdd(tmp, j, 0); break;
+    case 'w': for (j = 0; j < 256; j++) if (isalnum(j) || j == '_') clsAdd(tmp, j, 0); break;
+    case 's': for (j = 0; j < 256; j++) if (isspace(j)) clsAdd(tmp, j, 0); break;
+    default: return 0;
+  }
+  for (j = 0; j < 32; j++) cls[j] |= isupper(c) ? ~tmp[j] : tmp[j];
+  return 1;
+}
+
+static int rxEscapeChar(int c) {
+  switch (c) {
+    case 'n': return '\n';
+    case 't': return '\t';
+    case 'r': return '\r';
+    default: return c;
+  }
+}
+
+static rxnode *rxParseAlt(rxparser *ps);
+
+static rxnode *rxParseClass(rxparser *ps) {
+  rxnode *n = rxNode(RX_CLASS, NULL, NULL);
+  int neg = 0, first = 1, j;
+  if (*ps -> p == '^') {
+    neg = 1;
+    ps -> p++;
+  }
+  while (*ps -> p && (*ps -> p != ']' || first)) {
+    int c = (unsigned char)*ps -> p++;
+    first = 0;
+    if (c == '\\' && *ps -> p) {
+      c = (unsigned char)*ps -> p++;
+      if (rxEscapeClass(n -> cls, c)) continue;
+      c = rxEscapeChar(c);
+    }
+    if (ps -> p[0] == '-' && ps -> p[1] && ps -> p[1] != ']') {
+      int hi = (unsigned char)ps -> p[1];
+      ps -> p += 2;
+      if (hi == '\\' && *ps -> p) hi = rxEscapeChar((unsigned char)*ps -> p++);
+      for (j = c; j <= hi; j++) clsAdd(n -> cls, j, ps -> icase);
+    } else {
+      clsAdd(n -> cls, c, ps -> icase);
+    }
+  }
+  if (*ps -> p != ']') {
+    ps -> err = "missing ]";
+    rxFreeNode(n);
+    return NULL;
+  }
+  ps -> p++;
+  if (neg) {
+    for (j = 0; j < 32; j++) n -> cls[j] = ~n -> cls[j];
+    n -> cls['\n' >> 3] &= ~(1 << ('\n' & 7));
+  }
+  return n;
+}
+
+static rxnode *rxParseAtom(rxparser *ps) {
+  int c = (unsigned char)*ps -> p++, j;
+  rxnode *n;
+  switch (c) {
+    case '(':
+      n = rxParseAlt(ps);
+      if (!n) return NULL;
+      if (*ps -> p != ')') {
+        ps -> err = "missing )";
+        rxFreeNode(n);
+        return NULL;
+      }
+      ps -> p++;
+      return n;
+    case '[':
+      return rxParseClass(ps);
+    case '.':
+      n = rxNode(RX_CLASS, NULL, NULL);
+      for (j = 0; j < 256; j++) if (j != '\n') clsAdd(n -> cls, j, 0);
+      return n;
+    case '^':
+      return rxNode(RX_BOL, NULL, NULL);
+    case '$':
+      return rxNode(RX_EOL, NULL, NULL);
+    case '*': case '+': case '?':
+      ps -> err = "nothing to repeat";
+      return NULL;
+    case '\\':
+      if (*ps -> p == '\0') {
+        ps -> err = "trailing \\";
+        return NULL;
+      }
+      c = (unsigned char)*ps -> p++;
+      n = rxNode(RX_CLASS, NULL, NULL);
+      if (!rxEscapeClass(n -> cls, c)) clsAdd(n -> cls, rxEscapeChar(c), ps -> icase);
+      return n;
+    default:
+      n = rxNode(RX_CLASS, NULL, NULL);
+      clsAdd(n -> cls, c, ps -> icase);
+      return n;
+  }
+}
+
+static rxnode *rxParseRepeat(rxparser *ps) {
+  rxnode *n = rxParseAtom(ps);
+  while (n) {
+    int c = *ps -> p;
+    if (c == '*') n = rxNode(RX_STAR, n, NULL);
+    else if (c == '+') n = rxNode(RX_PLUS, n, NULL);
+    else if (c == '?') n = rxNode(RX_QUEST, n, NULL);
+    else break;
+    ps -> p++;
+  }
+  return n;
+}
+
+static rxnode *rxParseCat(rxparser *ps) {
+  rxnode *left = NULL;
+  while (*ps -> p && *ps -> p != '|' && *ps -> p != ')') {
+    rxnode *right = rxParseRepeat(ps);
+    if (!right) {
+      rxFreeNode(left);
+      return NULL;
+    }
+    left = left ? rxNode(RX_CAT, left, right) : right;
+  }
+  return left ? left : rxNode(RX_EMPTY, NULL, NULL);
+}
+
+static rxnode *rxParseAlt(rxparser *ps) {
+  rxnode *left = rxParseCat(ps);
+  while (left && *ps -> p == '|') {
+    ps -> p++;
+    rxnode *right = rxParseCat(ps);
+    if (!right) {
+      rxFreeNode(left);
+      return NULL;
+    }
+    left = rxNode(RX_ALT, left, right);
+  }
+  return left;
+}
+
+// NFA program. BOL and EOL assert that the scan is at its first or last
+// position; the backwards program swaps them, since ^ is where it ends
+enum rpOp { RP_CLASS, RP_SPLIT, RP_BOL, RP_EOL, RP_MATCH };
+
+typedef struct rpstate {
+  int op;
+  int out, out1;
+  unsigned char cls[32];
+} rpstate;
+
+typedef struct rprog {
+  rpstate *st;
+  int n, cap;
+  int start;
+} rprog;
+
+// a compiled piece of the NFA: its first state and the list of its dangling
+// exits, threaded through the exit slots themselves (slot = state * 2 + which)
+typedef struct rpfrag {
+  int start;
+  int patch;
+} rpfrag;
+
+static int rpAdd(rprog *p, int op) {
+  if (p -> n == p -> cap) {
+    p -> cap = p -> cap ? p -> cap * 2 : 16;
+    p -> st = realloc(p -> st, sizeof(rpstate) * p -> cap);
+  }
+  memset(&p -> st[p -> n], 0, sizeof(rpstate));
+  p -> st[p -> n].op = op;
+  p -> st[p -> n].out = p -> st[p -> n].out1 = -1;
+  return p -> n++;
+}
+
+static int *rpSlot(rprog *p, int slot) {
+  return slot & 1 ? &p -> st[slot >> 1].out1 : &p -> st[slot >> 1].out;
+}
+
+static void rpPatch(rprog *p, int list, int target) {
+  while (list != -1) {
+    int *slot = rpSlot(p, list);
+    list = *slot;
+    *slot = target;
+  }
+}
+
+static int rpAppend(rprog *p, int l1, int l2) {
+  if (l1 == -1) return l2;
+  int s = l1;
+  while (*rpSlot(p, s) != -1) s = *rpSlot(p, s);
+  *rpSlot(p, s) = l2;
+  return l1;
+}
+
+static rpfrag rpCompile(rprog *p, rxnode *n, int rev) {
+  rpfrag f, a, b;
+  int s;
+  switch (n -> type) {
+    case RX_CLASS:
+      s = rpAdd(p, RP_CLASS);
+      memcpy(p -> st[s].cls, n -> cls, 32);
+      f.start = s;
+      f.patch = s * 2;
+      return f;
+    case RX_CAT:
+      a = rpCompile(p, rev ? n -> b : n -> a, rev);
+      b = rpCompile(p, rev ? n -> a : n -> b, rev);
+      rpPatch(p, a.patch, b.start);
+      f.start = a.start;
+      f.patch = b.patch;
+      return f;
+    case RX_ALT:
+      a = rpCompile(p, n -> a, rev);
+      b = rpCompile(p, n -> b, rev);
+      s = rpAdd(p, RP_SPLIT);
+      p -> st[s].out = a.start;
+      p -> st[s].out1 = b.start;
+      f.start = s;
+      f.patch = rpAppend(p, a.patch, b.patch);
+      return f;
+    case RX_STAR:
+    case RX_PLUS:
+    case RX_QUEST:
+      a = rpCompile(p, n -> a, rev);
+      s = rpAdd(p, RP_SPLIT);
+      p -> st[s].out = a.start;
+      if (n -> type == RX_QUEST) {
+        f.start = s;
+        f.patch = rpAppend(p, a.patch, s * 2 + 1);
+      } else {
+        rpPatch(p, a.patch, s);
+        f.start = n -> type == RX_STAR ? s : a.start;
+        f.patch = s * 2 + 1;
+      }
+      return f;
+    case RX_BOL:
+    case RX_EOL:
+      s = rpAdd(p, (n -> type == RX_BOL) != rev ? RP_BOL : RP_EOL);
+      f.start = s;
+      f.patch = s * 2;
+      return f;
+    default: // RX_EMPTY, a split whose two exits go to the same place
+      s = rpAdd(p, RP_SPLIT);
+      p -> st[s].out = s * 2 + 1;
+      f.start = s;
+      f.patch = s * 2;
+      return f;
+  }
+}
+
+typedef struct regex {
+  rprog fwd, rev;
+} regex;
+
+// NULL with *err set if the pattern doesn't parse
+regex *regexCompile(const char *pattern, int icase, const char **err) {
+  rxparser ps = {pattern, icase, NULL};
+  rxnode *tree = rxParseAlt(&ps);
+  if (tree && *ps.p == ')') ps.err = "unmatched )";
+  if (!tree || ps.err) {
+    rxFreeNode(tree);
+    *err = ps.err;
+    return NULL;
+  }
+
+  regex *re = calloc(1, sizeof(regex));
+  rpfrag f = rpCompile(&re -> fwd, tree, 0);
+  rpPatch(&re -> fwd, f.patch, rpAdd(&re -> fwd, RP_MATCH));
+  re -> fwd.start = f.start;
+  f = rpCompile(&re -> rev, tree, 1);
+  rpPatch(&re -> rev, f.patch, rpAdd(&re -> rev, RP_MATCH));
+  re -> rev.start = f.start;
+  rxFreeNode(tree);
+  return re;
+}
+
+void regexFree(regex *re) {
+  if (!re) return;
+  free(re -> fwd.st);
+  free(re -> rev.st);
+  free(re);
+}
+
+typedef struct dstate {
+  int *set; // sorted NFA states
+  int n;
+  int accept; // a match ends here
+  int endaccept; // a match ends here if this is also the end of the scan, -1 until known
+  int idx; // position in dfa.st
+  unsigned hash;
+  struct dstate *hnext;
+  int next[256]; // index of the state after each byte, -1 until known
+} dstate;
+
+// the lazily built DFA for one program. Not shared between threads
+typedef struct dfa {
+  rprog *prog;
+  int unanchored; // a match may start at every position, not just the first
+  dstate **st;
+  int nst;
+  dstate *hash[KILO_DFA_HASH];
+  int start[2]; // start state when not at / at the first position, -1 until known
+  int *stack, *mark, *seeds, *tmp;
+  int markgen;
+  int flushes;
+} dfa;
+
+void dfaInit(dfa *d, rprog *prog, int unanchored) {
+  memset(d, 0, sizeof(dfa));
+  d -> prog = prog;
+  d -> unanchored = unanchored;
+  d -> st = malloc(sizeof(dstate *) * KILO_DFA_STATES);
+  d -> stack = malloc(sizeof(int) * (prog -> n * 3 + 2));
+  d -> mark = calloc(prog -> n, sizeof(int));
+  d -> seeds = malloc(sizeof(int) * (prog -> n + 1));
+  d -> tmp = malloc(sizeof(int) * (prog -> n + 1));
+  d -> start[0] = d -> start[1] = -1;
+}
+
+static void dfaFlush(dfa *d) {
+  int j;
+  for (j = 0; j < d -> nst; j++) {
+    free(d -> st[j] -> set);
+    free(d -> st[j]);
+  }
+  d -> nst = 0;
+  d -> flushes++;
+  memset(d -> hash, 0, sizeof(d -> hash));
+  d -> start[0] = d -> start[1] = -1;
+}
+
+void dfaFree(dfa *d) {
+  dfaFlush(d);
+  free(d -> st);
+  free(d -> stack);
+  free(d -> mark);
+  free(d -> seeds);
+  free(d -> tmp);
+}
+
+static int intCmp(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+// follow the empty transitions from seeds; the resulting sorted set goes to out.
+// EOL states stay in the set so that endaccept can resume from them later
+static int dfaClosure(dfa *d, const int *seeds, int nseeds, int bol, int eol, int *out) {
+  int n = 0, sp = 0, j;
+  d -> markgen++;
+  for (j = 0; j < nseeds; j++) d -> stack[sp++] = seeds[j];
+  while (sp) {
+    int i = d -> stack[--sp];
+    if (i < 0 || d -> mark[i] == d -> markgen) continue;
+    d -> mark[i] = d -> markgen;
+    rpstate *st = &d -> prog -> st[i];
+    switch (st -> op) {
+      case RP_SPLIT:
+        d -> stack[sp++] = st -> out;
+        d -> stack[sp++] = st -> out1;
+        break;
+      case RP_BOL:
+        if (bol) d -> stack[sp++] = st -> out;
+        break;
+      case RP_EOL:
+        out[n++] = i;
+        if (eol) d -> stack[sp++] = st -> out;
+        break;
+      default:
+        out[n++] = i;
+    }
+  }
+  qsort(out, n, sizeof(int), intCmp);
+  return n;
+}
+
+static dstate *dfaIntern(dfa *d, const int *set, int n) {
+  unsigned h = 2166136261u;
+  dstate *s;
+  int j;
+  for (j = 0; j < n; j++) h = (h ^ set[j]) * 16777619u;
+  for (s = d -> hash[h % KILO_DFA_HASH]; s; s = s -> hnext)
+    if (s -> hash == h && s -> n == n && memcmp(s -> set, set, n * sizeof(int)) == 0) return s;
+
+  if (d -> nst == KILO_DFA_STATES) dfaFlush(d); // pathological pattern, start over
+  s = malloc(sizeof(dstate));
+  s -> set = malloc(sizeof(int) * (n ? n : 1));
+  memcpy(s -> set, set, n * sizeof(int));
+  s -> n = n;
+  s -> hash = h;
+  s -> accept = 0;
+  s -> endaccept = -1;
+  for (j = 0; j < n; j++)
+    if (d -> prog -> st[set[j]].op == RP_MATCH) s -> accept = 1;
+  memset(s -> next, 0xff, sizeof(s -> next));
+  s -> hnext = d -> hash[h % KILO_DFA_HASH];
+  d -> hash[h % KILO_DFA_HASH] = s;
+  s -> idx = d -> nst;
+  d -> st[d -> nst++] = s;
+  return s;
+}
+
+static dstate *dfaStart(dfa *d, int first) {
+  if (d -> start[first] != -1) return d -> st[d -> start[first]];
+  int n = dfaClosure(d, &d -> prog -> start, 1, first, 0, d -> tmp);
+  dstate *s = dfaIntern(d, d -> tmp, n);
+  d -> start[first] = s -> idx;
+  return s;
+}
+
+static dstate *dfaStep(dfa *d, dstate *s, unsigned char c) {
+  if (s -> next[c] != -1) return d -> st[s -> next[c]];
+  int nseeds = 0, j;
+  for (j = 0; j < s -> n; j++) {
+    rpstate *st = &d -> prog -> st[s -> set[j]];
+    if (st -> op == RP_CLASS && clsHas(st -> cls, c)) d -> seeds[nseeds++] = st -> out;
+  }
+  if (d -> unanchored) d -> seeds[nseeds++] = d -> prog -> start;
+  int n = dfaClosure(d, d -> seeds, nseeds, 0, 0, d -> tmp);
+  int flushes = d -> flushes;
+  dstate *t = dfaIntern(d, d -> tmp, n);
+  if (d -> flushes == flushes) s -> next[c] = t -> idx; // otherwise s is gone
+  return t;
+}
+
+static int dfaEndAccept(dfa *d, dstate *s) {
+  if (s -> endaccept == -1) {
+    int n = dfaClosure(d, s -> set, s -> n, 0, 1, d -> tmp), j;
+    s -> endaccept = 0;
+    for (j = 0; j < n; j++)
+      if (d -> prog -> st[d -> tmp[j]].op == RP_MATCH) s -> endaccept = 1;
+  }
+  return s -> endaccept;
+}
+
+typedef struct rxmatcher {
+  dfa fwd, rev;
+  unsigned char *starts; // starts[p] is 1 if a match can begin at p
+  long cap;
+  const int *cancel; // polled on long lines, NULL if nothing cancels the scan
+} rxmatcher;
+
+void rxMatcherInit(rxmatcher *m, regex *re, const int *cancel) {
+  dfaInit(&m -> fwd, &re -> fwd, 0);
+  dfaInit(&m -> rev, &re -> rev, 1);
+  m -> starts = NULL;
+  m -> cap = 0;
+  m -> cancel = cancel;
+}
+
+void rxMatcherFree(rxmatcher *m) {
+  dfaFree(&m -> fwd);
+  dfaFree(&m -> rev);
+  free(m -> starts);
+}
+
+static int rxCancelled(rxmatcher *m, long p) {
+  return (p & (KILO_RX_POLL - 1)) == 0 && m -> cancel && __atomic_load_n(m -> cancel, __ATOMIC_RELAXED);
+}
+
+// one pass backwards over the whole line marks in m -> starts every place a
+// match can begin, so finding all matches costs a single reverse scan. Returns
+// 0 if the scan was cancelled
+int regexStarts(rxmatcher *m, const char *line, long len) {
+  const unsigned char *text = (const unsigned char *)line;
+  long p = len;
+  if (m -> cap < len + 1) {
+    m -> cap = len + 1;
+    m -> starts = realloc(m -> starts, m -> cap);
+  }
+  dstate *s = dfaStart(&m -> rev, 1);
+  while (1) {
+    m -> starts[p] = s -> accept || (p == 0 && dfaEndAccept(&m -> rev, s));
+    if (p == 0) break;
+    if (rxCancelled(m, p)) return 0;
+    s = dfaStep(&m -> rev, s, text[--p]);
+  }
+  return 1;
+}
+
+// end of the longest match beginning at start, which regexStarts marked. -1 if
+// the scan was cancelled
+long regexLongest(rxmatcher *m, const char *line, long start, long len) {
+  const unsigned char *text = (const unsigned char *)line;
+  long p = start, end = start;
+  dstate *s = dfaStart(&m -> fwd, start == 0);
+  while (1) {
+    if (s -> accept || (p == len && dfaEndAccept(&m -> fwd, s))) end = p;
+    if (p == len || s -> n == 0) break;
+    if (rxCancelled(m, p - start + 1)) return -1;
+    s = dfaStep(&m -> fwd, s, text[p++]);
+  }
+  return end;
+}
+
+/*** find ***/
+#define KILO_SEARCH_PARTS 64 // row ranges a search is split into
+#define KILO_MAX_MATCHES 8000000 // matches kept in the index, the count goes on as "N+"
+
+// Searches run on a pool of worker threads. The rows are split into ranges
+// that workers take in turn, and every range collects its matches in document
+// order, so the finished ranges laid end to end are the sorted match index.
+// Workers only read the document. It can't change underneath them because the
+// search is cancelled before the prompt returns and editing resumes.
+typedef struct searchmatch {
+  int row;
+  int cx;
+} searchmatch;
+
+typedef struct searchpart {
+  int lo, hi; // rows [lo, hi)
+  int done;
+  int truncated;
+  int count, cap;
+  searchmatch *m;
+} searchpart;
+
+struct searchPool {
+  pthread_t *workers;
+  int nworkers;
+  pthread_mutex_t lock;
+  pthread_cond_t work; // there are parts to take
+  pthread_cond_t idle; // a worker finished a part
+  searcher s;
+  regex *re; // set instead of s for regex queries
+  const char *err; // why the regex didn't compile
+  searchpart *parts;
+  int nparts;
+  int next; // next part to hand out
+  int busy; // parts being scanned right now
+  int cancel;
+  int ndone, seen_done; // finished parts, and how many the screen knows about
+  int have_cur; // cur is a match the cursor was moved to
+  int user_moved; // arrows were used, stop jumping to the first match
+  searchmatch cur;
+};
+
+struct searchPool SP = {NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER, {0}, NULL, NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 0, {0, 0}};
+
+static void searchAddMatch(searchpart *part, int row, int cx) {
+  if (part -> count == part -> cap) {
+    if (part -> cap >= KILO_MAX_MATCHES / KILO_SEARCH_PARTS) {
+      part -> truncated = 1;
+      return;
+    }
+    part -> cap = part -> cap ? part -> cap * 2 : 64;
+    part -> m = realloc(part -> m, sizeof(searchmatch) * part -> cap);
+  }
+  part -> m[part -> count].row = row;
+  part -> m[part -> count].cx = cx;
+  part -> count++;
+}
+
+// every match of the regex in one line, which regexStarts needs in one piece
+static void searchRegexLine(searchpart *part, rxmatcher *m, int at, const char *line, long len) {
+  long from = 0, start, end;
+  if (!regexStarts(m, line, len)) return;
+  while (from <= len) {
+    unsigned char *hit = memchr(m -> starts + from, 1, len + 1 - from);
+    if (!hit) break;
+    start = hit - m -> starts;
+    if ((end = regexLongest(m, line, start, len)) == -1) return;
+    searchAddMatch(part, at, start);
+    from = end > start ? end : start + 1;
+  }
+}
+
+// Compressed cold chunks are decompressed by the worker into a buffer of its
+// own, with where each line starts, since no other thread touches the block
+struct searchText {
+  char *text;
+  int cap;
+  off_t *lineoff; // nrows + 1 entries, the last one is the end of the text
+  int lcap;
+};
+
+static void searchThaw(struct searchText *t, zblock *z) {
+  int j;
+  char *p;
+  if (t -> cap < z -> rawlen + 1) {
+    t -> cap = z -> rawlen + 1;
+    t -> text = realloc(t -> text, t -> cap);
+  }
+  if (t -> lcap < z -> nrows + 1) {
+    t -> lcap = z -> nrows + 1;
+    t -> lineoff = realloc(t -> lineoff, sizeof(off_t) * t -> lcap);
+  }
+  lzDecompress(z -> data, z -> zlen, t -> text, z -> rawlen);
+  for (j = 0, p = t -> text; j < z -> nrows; j++) {
+    t -> lineoff[j] = p - t -> text;
+    p = (char *)memchr(p, '\n', t -> text + z -> rawlen - p) + 1;
+  }
+  t -> lineoff[z -> nrows] = z -> rawlen;
+}
+
+static void searchScanRegex(searchpart *part) {
+  rxmatcher m;
+  struct searchText t = {NULL, 0, NULL, 0};
+  char *buf = NULL;
+  int bufcap = 0;
+  int at = part -> lo, idx, rank;
+  chunk *c = docLocate(at, &idx, &rank);
+  rxMatcherInit(&m, SP.re, &SP.cancel);
+  while (c && at < part -> hi && !part -> truncated) {
+    if (__atomic_load_n(&SP.cancel, __ATOMIC_RELAXED)) break;
+    int stop = c -> nrows;
+    if (at - idx + stop > part -> hi) stop = part -> hi - (at - idx);
+    erow *rows = __atomic_load_n(&c -> rows, __ATOMIC_ACQUIRE);
+    if (!rows && c -> z) searchThaw(&t, c -> z);
+    for (; idx < stop; idx++, at++) {
+      const char *line;
+      int len;
+      if (!rows && c -> z) {
+        line = t.text + t.lineoff[idx];
+        len = t.lineoff[idx + 1] - t.lineoff[idx] - 1;
+      } else if (!rows) {
+        line = editorLineBytes(c -> first + idx, &len);
+      } else {
+        erow *row = &rows[idx];
+        len = row -> size;
+        if (row -> gap == row -> size) {
+          line = row -> chars;
+        } else if (row -> gap == 0) {
+          line = row -> chars + row -> cap - row -> size;
+        } else { // text on both sides of the gap, copy it together
+          if (bufcap < row -> size) {
+            bufcap = row -> size;
+            buf = realloc(buf, bufcap);
+          }
+          memcpy(buf, row -> chars, row -> gap);
+          memcpy(buf + row -> gap, row -> chars + row -> cap - (row -> size - row -> gap), row -> size - row -> gap);
+          line = buf;
+        }
+      }
+      searchRegexLine(part, &m, at, line, len);
+    }
+    c = c -> next;
+    idx = 0;
+  }
+  rxMatcherFree(&m);
+  free(buf);
+  free(t.text);
+  free(t.lineoff);
+}
+
+static void searchScanPart(searchpart *part) {
+  if (SP.re) {
+    searchScanRegex(part);
+    return;
+  }
+  const searcher *s = &SP.s;
+  struct searchText t = {NULL, 0, NULL, 0};
+  long step = s -> n;
+  int at = part -> lo, idx, rank;
+  chunk *c = docLocate(at, &idx, &rank);
+  while (c && at < part -> hi && !part -> truncated) {
+    if (__atomic_load_n(&SP.cancel, __ATOMIC_RELAXED)) break;
+    int stop = c -> nrows;
+    if (at - idx + stop > part -> hi) stop = part -> hi - (at - idx);
+    erow *rows = __atomic_load_n(&c -> rows, __ATOMIC_ACQUIRE);
+    if (rows) {
+      for (; idx < stop; idx++, at++) {
+        long off = 0;
+        while ((off = searchRow(s, &rows[idx], off)) != -1) {
+          searchAddMatch(part, at, off);
+          off += step;
+        }
+      }
+    } else {
+      // a cold chunk is one contiguous run of the mapping or of its block, scan all of it at once
+      const char *base = E.map;
+      const off_t *lineoff = E.lineoff;
+      int first = c -> first;
+      off_t finish;
+      if (c -> z) {
+        searchThaw(&t, c -> z);
+        base = t.text;
+        lineoff = t.lineoff;
+        first = 0;
+        finish = lineoff[stop];
+      } else {
+        finish = first + stop < E.nlines ? E.lineoff[first + stop] : (off_t)E.maplen;
+      }
+      int line = first + idx, last = first + stop;
+      off_t pos = lineoff[line];
+      long off;
+      while ((off = searchFind(s, base + pos, finish - pos)) != -1) {
+        pos += off;
+        // the query has no newlines, so the match is in the last line starting at or before it
+        while (line + 1 < last && lineoff[line + 1] <= pos) line++;
+        searchAddMatch(part, at + (line - first - idx), pos - lineoff[line]);
+        pos += step;
+      }
+      at += stop - idx;
+    }
+    c = c -> next;
+    idx = 0;
+  }
+  free(t.text);
+  free(t.lineoff);
 }
 
-void editorDelChar() {
-  if (E.cy == E.numrows) return;
-  if (E.cx == 0 && E.cy == 0) return;
+static void *searchWorker(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&SP.lock);
+  while (1) {
+    while (SP.cancel || SP.next >= SP.nparts) pthread_cond_wait(&SP.work, &SP.lock);
+    searchpart *part = &SP.parts[SP.next++];
+    SP.busy++;
+    pthread_mutex_unlock(&SP.lock);
 
-  erow *row = &E.row[E.cy];
-  if (E.cx > 0) {
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--;
-  } else {
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row -> chars, row -> size);
-    editorDelRow(E.cy);
-    E.cy--;
+    searchScanPart(part);
+
+    pthread_mutex_lock(&SP.lock);
+    SP.busy--;
+    if (!SP.cancel) {
+      __atomic_store_n(&part -> done, 1, __ATOMIC_RELEASE);
+      __atomic_store_n(&SP.ndone, SP.ndone + 1, __ATOMIC_RELEASE);
+      editorWake();
+    }
+    pthread_cond_broadcast(&SP.idle);
   }
+  return NULL;
 }
 
-/*** file i/o ***/
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
+// cancel the scan in flight, wait for the workers to let go of the document and drop the index
+void searchStop() {
+  int j;
+  pthread_mutex_lock(&SP.lock);
+  __atomic_store_n(&SP.cancel, 1, __ATOMIC_RELAXED);
+  while (SP.busy) pthread_cond_wait(&SP.idle, &SP.lock);
+  for (j = 0; j < SP.nparts; j++) free(SP.parts[j].m);
+  free(SP.parts);
+  SP.parts = NULL;
+  SP.nparts = SP.next = SP.ndone = SP.seen_done = 0;
+  SP.have_cur = SP.user_moved = 0;
+  SP.cancel = 0;
+  pthread_mutex_unlock(&SP.lock);
+}
+
+void searchStart(const char *query) {
   int j;
-  for (j = 0; j < E.numrows; j++)
-    totlen += E.row[j].size + 1;
-  *buflen = totlen;
+  searchStop();
+  regexFree(SP.re);
+  SP.re = NULL;
+  SP.err = NULL;
+  if (query[0] == '\0' || E.numrows == 0) return;
 
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars,  E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
+  if (SP.workers == NULL) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    SP.nworkers = n < 1 ? 1 : n > 16 ? 16 : n;
+    SP.workers = malloc(sizeof(pthread_t) * SP.nworkers);
+    for (j = 0; j < SP.nworkers; j++) pthread_create(&SP.workers[j], NULL, searchWorker, NULL);
   }
 
-  return buf;
-}
+  if (E.search_regex) {
+    SP.re = regexCompile(query, E.search_icase, &SP.err);
+    if (!SP.re) return;
+  } else {
+    searchCompile(&SP.s, query, E.search_icase);
+  }
+  int nparts = E.numrows < KILO_SEARCH_PARTS ? E.numrows : KILO_SEARCH_PARTS;
+  searchpart *parts = calloc(nparts, sizeof(searchpart));
+  for (j = 0; j < nparts; j++) {
+    parts[j].lo = (long long)E.numrows * j / nparts;
+    parts[j].hi = (long long)E.numrows * (j + 1) / nparts;
+  }
 
-void editorOpen(char *filename) {
-  free(E.filename);
-  E.filename = strdup(filename);
+  pthread_mutex_lock(&SP.lock);
+  SP.parts = parts;
+  SP.nparts = nparts;
+  pthread_cond_broadcast(&SP.work);
+  pthread_mutex_unlock(&SP.lock);
+}
 
-  FILE *fp = fopen(filename, "r");
-  if (!fp) die("fopen");
+static int searchCmp(const searchmatch *a, const searchmatch *b) {
+  if (a -> row != b -> row) return a -> row < b -> row ? -1 : 1;
+  return a -> cx < b -> cx ? -1 : a -> cx > b -> cx;
+}
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  linelen = getline(&line, &linecap, fp);
+// index of the first match in part that is after m (or at it, if inclusive)
+static int searchBound(searchpart *part, const searchmatch *m, int inclusive) {
+  int lo = 0, hi = part -> count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    int c = searchCmp(&part -> m[mid], m);
+    if (c < 0 || (c == 0 && !inclusive)) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
 
-  while ((linelen = getline(&line, &linecap, fp)) != -1)
-  {
-    while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) linelen--;
-    editorInsertRow(E.numrows, line, linelen);
+// the part whose row range holds row
+static int searchPartOf(int row) {
+  int lo = 0, hi = SP.nparts - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (SP.parts[mid].lo <= row) lo = mid;
+    else hi = mid - 1;
   }
-  free(line);
-  fclose(fp);
-  E.dirty = 0;
+  return lo;
 }
 
-void editorSave() {
-  if (E.filename == NULL) {
-    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-    if (E.filename == NULL) {
-      editorSetStatusMessage("Save aborted");
-      return;
+static void searchSelect(searchmatch *m) {
+  SP.cur = *m;
+  SP.have_cur = 1;
+  E.cy = m -> row;
+  E.cx = m -> cx;
+  E.rowoff = E.numrows; // scroll so the match ends up at the top
+}
+
+// move to the next (dir 1) or previous (dir -1) match among the finished
+// parts, wrapping around (back into the starting part last). Binary searches,
+// so O(log N)
+void searchStep(int dir) {
+  int j, n = SP.nparts;
+  if (n == 0) return;
+  SP.user_moved = 1;
+  int start = SP.have_cur ? searchPartOf(SP.cur.row) : (dir > 0 ? 0 : n - 1);
+  for (j = 0; j <= n; j++) {
+    int p = ((start + dir * j) % n + n) % n;
+    searchpart *part = &SP.parts[p];
+    if (!__atomic_load_n(&part -> done, __ATOMIC_ACQUIRE) || part -> count == 0) continue;
+    int k;
+    if (j == 0 && SP.have_cur) {
+      k = dir > 0 ? searchBound(part, &SP.cur, 0) : searchBound(part, &SP.cur, 1) - 1;
+      if (k < 0 || k >= part -> count) continue;
+    } else {
+      k = dir > 0 ? 0 : part -> count - 1;
     }
+    searchSelect(&part -> m[k]);
+    return;
   }
+}
 
-  int len; 
-  char *buf = editorRowsToString(&len);
-
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  // O_RDWR opens for reating and writing
-  // O_CREAT creates file if not exists
-  // 0644 is the standard permissions typically used for text files, gives the owner permission to read/write the file, everyone else can only read
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-  // set file's size to specified length. if larger, cut off extra data at end. if shorter, add 0 btyes to make it that length
-  // typically, file overwritten by passing O_TRUNC to open(): truncates file completely, making it empty before new data written
-  // made safer by manually calling ftruncate() as all data would have been gone if we used open() and write() failed, not as in this case
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
+// new parts finished since the last look: jump to the first match in the
+// file once it's known, unless the user already moved. Returns 1 if the
+// screen needs to be redrawn
+int searchPoll() {
+  int j;
+  int done = __atomic_load_n(&SP.ndone, __ATOMIC_ACQUIRE);
+  if (SP.nparts == 0 || done == SP.seen_done) return 0;
+  SP.seen_done = done;
+  if (!SP.user_moved && !SP.have_cur) {
+    for (j = 0; j < SP.nparts; j++) {
+      searchpart *part = &SP.parts[j];
+      if (!__atomic_load_n(&part -> done, __ATOMIC_ACQUIRE)) break;
+      if (part -> count) {
+        searchSelect(&part -> m[0]);
+        break;
       }
     }
-    close(fd);
   }
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+  return 1;
 }
 
-/*** find ***/
-void editorFindCallback(char *query, int key) {
-  static int last_match = -1;
-  static int direction = 1;
+// "match k of N" for the status bar
+int searchStatus(char *buf, int size) {
+  int j, total = 0, before = 0, truncated = 0, done = 0;
+  for (j = 0; j < SP.nparts; j++) {
+    searchpart *part = &SP.parts[j];
+    if (!__atomic_load_n(&part -> done, __ATOMIC_ACQUIRE)) continue;
+    done++;
+    truncated |= part -> truncated;
+    if (SP.have_cur && part -> lo <= SP.cur.row) {
+      if (SP.cur.row < part -> hi) before += searchBound(part, &SP.cur, 1);
+      else before += part -> count;
+    }
+    total += part -> count;
+  }
+  const char *more = done < SP.nparts ? " ..." : "";
+  if (SP.have_cur)
+    return snprintf(buf, size, "match %d of %d%s%s", before + 1, total, truncated ? "+" : "", more);
+  if (SP.nparts)
+    return snprintf(buf, size, "%d matches%s%s", total, truncated ? "+" : "", more);
+  if (SP.err)
+    return snprintf(buf, size, "bad regex: %s", SP.err);
+  return snprintf(buf, size, "no query");
+}
 
+void editorFindCallback(char *query, int key) {
   if (key == '\r' || key == '\x1b') {
-    last_match = -1;
-    direction = 1;
-    return;
+    searchStop();
+    searchFree(&SP.s);
+    regexFree(SP.re);
+    SP.re = NULL;
   } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-    direction = 1;
+    searchStep(1);
   } else if (key == ARROW_LEFT || key == ARROW_UP) {
-    direction = -1;
+    searchStep(-1);
   } else {
-    last_match = -1;
-    direction = 1;
-  }
-
-  if (last_match == -1) direction = 1;
-  int current = last_match;
-  int i;
-  for (i = 0; i < E. numrows; i++) {
-    current += direction;
-    if (current == -1) current = E.numrows - 1;
-    else if (current == E.numrows) current = 0;
-
-    erow *row = &E.row[current];
-    char *match = strstr(row -> render, query);
-    if (match) {
-      last_match = current;
-      E.cy = current;
-      E.cx = editorRowRxToCx(row, match - row -> render);
-      E.rowoff = E.numrows;
-      break;
-    }
+    if (key == CTRL_KEY('t')) E.search_icase = !E.search_icase;
+    if (key == CTRL_KEY('r')) E.search_regex = !E.search_regex;
+    searchStart(query); // cancels the scan for the previous query
   }
 }
 
@@ -495,7 +4975,9 @@ void editorFind() {
   int saved_coloff = E.coloff;
   int saved_rowoff = E.rowoff;
 
-  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+  E.searching = 1;
+  char *query = editorPrompt("Search: %s (ESC/Arrows/Enter, Ctrl-T case, Ctrl-R regex)", editorFindCallback);
+  E.searching = 0;
   if (query) 
   {
     free(query);
@@ -507,6 +4989,102 @@ void editorFind() {
   }
 }
 
+static double benchNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// scan the whole document on this thread and report the match count and throughput
+static void benchScan(const char *label) {
+  searchpart part;
+  int j;
+  long long count = 0;
+  double best = 1e30;
+  for (j = 0; j < 3; j++) {
+    memset(&part, 0, sizeof(part));
+    double t = benchNow();
+    while (part.lo < E.numrows) { // in KILO_SEARCH_PARTS pieces, so the index doesn't fill up
+      part.hi = part.lo + (E.numrows + KILO_SEARCH_PARTS - 1) / KILO_SEARCH_PARTS;
+      if (part.hi > E.numrows) part.hi = E.numrows;
+      part.count = part.truncated = 0;
+      searchScanPart(&part);
+      count += part.count;
+      part.lo = part.hi;
+    }
+    t = benchNow() - t;
+    if (t < best) best = t;
+    free(part.m);
+  }
+  printf("%-8s %10lld matches %9.2f ms %9.1f MB/s\n", label, count / 3, best * 1e3,
+      E.maplen / best / 1e6);
+}
+
+// kilo --bench-search file pattern: the same query through the literal engine
+// and the regex engine, single threaded
+int editorBenchSearch(const char *filename, const char *pattern) {
+  const char *err;
+  editorOpen((char *)filename);
+  printf("%s: %d lines, %ld bytes\n", filename, E.numrows, (long)E.maplen);
+
+  searchCompile(&SP.s, pattern, 0);
+  benchScan("literal");
+  searchFree(&SP.s);
+
+  SP.re = regexCompile(pattern, 0, &err);
+  if (!SP.re) {
+    fprintf(stderr, "bad regex: %s\n", err);
+    return 1;
+  }
+  benchScan("regex");
+  regexFree(SP.re);
+  SP.re = NULL;
+  return 0;
+}
+
+// kilo --bench-open file [threads]: the line index built with 1, 2, 4, ...
+// threads, up to one per CPU unless told otherwise. The mapping is faulted in
+// once first, so this is the scan and merge alone
+int editorBenchOpen(const char *filename, int max) {
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0) {
+    fprintf(stderr, "%s: can't open or empty\n", filename);
+    return 1;
+  }
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (max < 1) max = cpus < 1 ? 1 : cpus;
+  if (max > KILO_LOAD_THREADS) max = KILO_LOAD_THREADS;
+  off_t *lineoff;
+  int lines = lineIndex(map, st.st_size, max, &lineoff);
+  free(lineoff);
+  printf("%s: %d lines, %lld bytes\n", filename, lines, (long long)st.st_size);
+
+  double base = 0;
+  int n, j;
+  for (n = 1; ; n = n * 2 > max ? max : n * 2) {
+    double best = 1e30;
+    for (j = 0; j < 3; j++) {
+      double t = benchNow();
+      lineIndex(map, st.st_size, n, &lineoff);
+      t = benchNow() - t;
+      free(lineoff);
+      if (t < best) best = t;
+    }
+    if (n == 1) base = best;
+    printf("%3d threads %10.2f ms %8.2f GB/s %6.2fx\n", n, best * 1e3, st.st_size / best / 1e9, base / best);
+    if (n == max) break;
+  }
+  munmap(map, st.st_size);
+  close(fd);
+  return 0;
+}
+
 /*** append buffer ***/
 
 struct abuf {
@@ -518,6 +5096,7 @@ struct abuf {
 
 void abAppend(struct abuf *ab, const char *s, int len)
 {
+  if (len == 0) return; // realloc(p, 0) may free p
   char *new = realloc(ab -> b, ab -> len + len);
 
   if (new == NULL) return;
@@ -533,9 +5112,16 @@ void abFree(struct abuf *ab)
 
 /*** output ***/
 void editorScroll() {
+  int rw = 1; // columns of the character under the cursor, all of a wide one has to show
   E.rx = E.cx;
   if (E.cy < E.numrows) {
-    E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    erow *row = editorRowAt(E.cy);
+    E.rx = editorRowCxToRx(row, E.cx);
+    if (E.cx < row -> size && (editorRowChar(row, E.cx) & 0x80)) {
+      unsigned cp;
+      editorRowDecode(row, E.cx, &cp);
+      if (charWidth(cp) > rw) rw = charWidth(cp);
+    }
   }
 
   if (E.cy < E.rowoff) {
@@ -548,16 +5134,108 @@ void editorScroll() {
   {
     E.coloff = E.rx;
   }
-  if (E.rx >= E.coloff + E.screencols) {
-    E.coloff = E.rx - E.screencols + 1;
+  if (E.rx + rw > E.coloff + E.screencols) {
+    E.coloff = E.rx + rw - E.screencols;
+  }
+}
+
+unsigned editorHash(const char *s, int len) {
+  unsigned h = 2166136261u; // FNV-1a
+  int j;
+  for (j = 0; j < len; j++) {
+    h ^= (unsigned char)s[j];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// forget what is on the terminal, the next frame repaints every line
+void editorInvalidateScreen() {
+  int y;
+  for (y = 0; y < E.screenrows + 2; y++) E.shadow[y].valid = 0;
+  E.shadow_cy = E.shadow_cx = -1;
+  E.shadow_rowoff = E.shadow_coloff = -1;
+}
+
+// the terminal changed size: start over with a shadow of the new size and a full repaint
+void editorResize() {
+  struct winsize ws;
+  int y;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) return;
+  for (y = 0; y < E.screenrows + 2; y++) free(E.shadow[y].b);
+  E.screenrows = ws.ws_row > 3 ? ws.ws_row - 2 : 1;
+  E.screencols = ws.ws_col;
+  E.shadow = realloc(E.shadow, sizeof(screenline) * (E.screenrows + 2));
+  memset(E.shadow, 0, sizeof(screenline) * (E.screenrows + 2));
+  editorInvalidateScreen();
+  rcacheReserve(E.screenrows * 4);
+  E.redraw = 1;
+}
+
+// When the view moved vertically by less than a screen, have the terminal shift
+// what it already shows instead of repainting it: limit scrolling to the text
+// area with DECSTBM (<esc>[top;bottomr), scroll with SU (<esc>[nS, content moves
+// up) or SD (<esc>[nT, content moves down), then reset the region. Shifting
+// E.shadow the same way leaves only the newly exposed lines to be drawn.
+void editorScrollScreen(struct abuf *ab) {
+  int d = E.rowoff - E.shadow_rowoff;
+  if (E.shadow_rowoff == -1 || E.coloff != E.shadow_coloff) return;
+  if (d == 0 || d >= E.screenrows || -d >= E.screenrows) return;
+
+  char buf[48];
+  snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r", E.screenrows, d > 0 ? d : -d, d > 0 ? 'S' : 'T');
+  abAppend(ab, buf, strlen(buf));
+
+  // rotate the shadow lines, reusing the buffers of the ones scrolled away for the blank ones
+  int n = d > 0 ? d : -d;
+  int keep = E.screenrows - n;
+  screenline *tmp = malloc(sizeof(screenline) * n);
+  if (d > 0) {
+    memcpy(tmp, E.shadow, sizeof(screenline) * n);
+    memmove(E.shadow, &E.shadow[n], sizeof(screenline) * keep);
+    memcpy(&E.shadow[keep], tmp, sizeof(screenline) * n);
+  } else {
+    memcpy(tmp, &E.shadow[keep], sizeof(screenline) * n);
+    memmove(&E.shadow[n], E.shadow, sizeof(screenline) * keep);
+    memcpy(E.shadow, tmp, sizeof(screenline) * n);
+  }
+  free(tmp);
+
+  int y, blank = d > 0 ? keep : 0;
+  for (y = blank; y < blank + n; y++) {
+    E.shadow[y].len = 0;
+    E.shadow[y].hash = editorHash("", 0);
+    E.shadow[y].valid = 1;
   }
+  E.shadow_cy = E.shadow_cx = -1; // resetting the region homes the cursor
+}
+
+// send screen line y unless the terminal already shows exactly that
+void editorFlushLine(struct abuf *ab, int y, struct abuf *line) {
+  screenline *sl = &E.shadow[y];
+  unsigned h = editorHash(line -> b, line -> len);
+  if (sl -> valid && sl -> hash == h && sl -> len == line -> len && (line -> len == 0 || memcmp(sl -> b, line -> b, line -> len) == 0)) return;
+
+  char buf[32];
+  snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1); // move to the start of the line
+  abAppend(ab, buf, strlen(buf));
+  abAppend(ab, line -> b, line -> len);
+  abAppend(ab, "\x1b[K", 3); // clear the rest of the line
+
+  sl -> b = realloc(sl -> b, line -> len ? line -> len : 1);
+  if (line -> len) memcpy(sl -> b, line -> b, line -> len);
+  sl -> len = line -> len;
+  sl -> hash = h;
+  sl -> valid = 1;
 }
 
 void editorDrawRows(struct abuf *ab)
 {
+  struct abuf line = ABUF_INIT;
   int y;
   for (y = 0; y < E.screenrows; y++)
   {
+    line.len = 0;
     int filerow = y + E.rowoff;
     if (filerow >= E.numrows)
     {
@@ -569,69 +5247,137 @@ void editorDrawRows(struct abuf *ab)
         int padding = (E.screencols - welcomelen) / 2;
         if (padding)
         {
-          abAppend(ab, "~", 1);
+          abAppend(&line, "~", 1);
           padding--;
         }
-        while (padding--) abAppend(ab, " ", 1);
-        abAppend(ab, welcome, welcomelen);
+        while (padding--) abAppend(&line, " ", 1);
+        abAppend(&line, welcome, welcomelen);
       }
       else 
       {
-        abAppend(ab, "~", 1);
+        abAppend(&line, "~", 1);
       }
     } 
     else 
     {
-      int len = E.row[filerow].rsize - E.coloff;
-      if (len < 0) len = 0;
-      if (len > E.screencols) len = E.screencols;
-      abAppend(ab, &E.row[filerow].render[E.coloff], len);
+      unsigned char *hl = editorRowColors(filerow); // before the render, it may render rows above
+      rcache *rc = editorRowRender(editorRowAt(filerow), E.coloff, E.screencols);
+      int off, len, pad = 0;
+      if (rc -> ascii) {
+        off = E.coloff - rc -> roff;
+        len = rc -> rsize - off;
+        if (len < 0) len = 0;
+        if (len > E.screencols) len = E.screencols;
+      } else {
+        editorRenderClip(rc, E.coloff, E.screencols, &off, &len, &pad);
+      }
+      while (pad--) abAppend(&line, " ", 1);
+      if (hl == NULL) {
+        if (len) abAppend(&line, &rc -> render[off], len);
+      } else {
+        // a color escape only where the color changes, back to the default at the end
+        int j = off, color = 39;
+        while (j < off + len) {
+          int next = editorSyntaxToColor(hl[j]);
+          int run = j + 1;
+          while (run < off + len && editorSyntaxToColor(hl[run]) == next) run++;
+          if (next != color) {
+            char buf[16];
+            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", next);
+            abAppend(&line, buf, clen);
+            color = next;
+          }
+          abAppend(&line, &rc -> render[j], run - j);
+          j = run;
+        }
+        if (color != 39) abAppend(&line, "\x1b[39m", 5);
+      }
     }
 
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
+    editorFlushLine(ab, y, &line);
   }
+  abFree(&line);
 }
 
 void editorDrawStatusBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[7m", 4); // switch to inverted colors
+  struct abuf line = ABUF_INIT;
+  abAppend(&line, "\x1b[7m", 4); // switch to inverted colors
   // 1: bold
   // 4: underscore
   // 5: blink
   // 7: inverted colors
   // alternatively, could use all, e.g. <esc>[1;4;5;7m
   char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.filename ? E.filename : "[No Name]", E.numrows, E.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", E.cy + 1, E.numrows);
+  int len;
+  if (E.load_rate > 0)
+    len = snprintf(status, sizeof(status), "%.20s - %d lines, loaded at %.2f GB/s %s", E.filename ? E.filename : "[No Name]",
+        E.numrows, E.load_rate, E.dirty ? "(modified)" : "");
+  else
+    len = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.filename ? E.filename : "[No Name]", E.numrows, E.dirty ? "(modified)" : "");
+  int rlen;
+  if (E.searching) {
+    char matches[48];
+    searchStatus(matches, sizeof(matches));
+    rlen = snprintf(rstatus, sizeof(rstatus), "%s%s%s", E.search_regex ? "[regex] " : "",
+        E.search_icase ? "[ignore case] " : "", matches);
+  } else {
+    rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", E.syntax ? E.syntax -> filetype : "no ft", E.cy + 1, E.numrows);
+  }
   if (len > E.screencols) len = E.screencols;
-  abAppend(ab, status, len);
+  abAppend(&line, status, len);
   while (len < E.screencols) {
     if (E.screencols - len == rlen) {
-      abAppend(ab, rstatus, rlen);
+      abAppend(&line, rstatus, rlen);
       break;
     } else {
-      abAppend(ab, " ", 1);
+      abAppend(&line, " ", 1);
       len++;
     }
   }
-  abAppend(ab, "\x1b[m", 3); // return to normal formatting
+  abAppend(&line, "\x1b[m", 3); // return to normal formatting
   // argument of 0 clears all attributes previously assigned
   // 0 is default argument, so can directly use <esc>[m
-  abAppend(ab, "\r\n", 2); // add line for status bar and messages
+  editorFlushLine(ab, E.screenrows, &line);
+  abFree(&line);
 }
 
 void editorDrawMessageBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[K", 3); // clear message bar
+  struct abuf line = ABUF_INIT;
   int msglen = strlen(E.statusmsg);
   if (msglen > E.screencols) msglen = E.screencols;
 
   // only display message if less than 5 seconds old
-  if (msglen && time(NULL) - E.statusmsg_time < 5) 
-    abAppend(ab, E.statusmsg, msglen);
+  if (msglen && (E.prompting || time(NULL) - E.statusmsg_time < 5)) {
+    abAppend(&line, E.statusmsg, msglen);
+  } else if (ST.on) {
+    char stats[160];
+    int len = statOverlay(stats, sizeof(stats));
+    abAppend(&line, stats, len < E.screencols ? len : E.screencols);
+  }
+  editorFlushLine(ab, E.screenrows + 1, &line);
+  abFree(&line);
+}
+
+// write all of buf, a short write would leave the terminal out of step with E.shadow
+void editorWriteOut(const char *buf, int len) {
+#ifdef KILO_HEADLESS
+  vtWrite(buf, len);
+  return;
+#endif
+  while (len > 0) {
+    ssize_t n = write(STDOUT_FILENO, buf, len);
+    if (n == -1) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      return;
+    }
+    buf += n;
+    len -= n;
+  }
 }
 
 void editorRefreshScreen()
 {
+  long long t = statNow();
   editorScroll();
   
   struct abuf ab = ABUF_INIT;
@@ -645,22 +5391,41 @@ void editorRefreshScreen()
   // <esc>[1J = clear screen up to where cursor is
   // <esc>[0J = clear screen from cursor to end - this is also the default argument so <es>[J has the same effect
   // <esc>[2J = clear the entire screen
-  abAppend(&ab, "\x1b[H", 3);
-  // position cursor 
-  // by default, row col args are 1 so this has same effect as <esc>[1;1H
-  // can modify to move cursor to other areas
+  // Lines are only sent when they differ from the last frame, each one positioned
+  // with <esc>[row;1H, so a frame where nothing changed writes nothing at all.
 
+  editorScrollScreen(&ab);
   editorDrawRows(&ab);
   editorDrawStatusBar(&ab);
   editorDrawMessageBar(&ab);
+  E.shadow_rowoff = E.rowoff;
+  E.shadow_coloff = E.coloff;
 
-  char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-  abAppend(&ab, buf, strlen(buf));
+  int changed = ab.len > 6;
+  if (!changed) ab.len = 0; // no need to hide the cursor
 
-  abAppend(&ab, "\x1b[?25h", 6); // show cursor after printing
-  
-  write(STDOUT_FILENO, ab.b, ab.len);
+  int cy = (E.cy - E.rowoff) + 1, cx = (E.rx - E.coloff) + 1;
+  if (changed || cy != E.shadow_cy || cx != E.shadow_cx) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cy, cx);
+    abAppend(&ab, buf, strlen(buf));
+    E.shadow_cy = cy;
+    E.shadow_cx = cx;
+  }
+
+  if (changed) abAppend(&ab, "\x1b[?25h", 6); // show cursor after printing
+  statEnd(STAT_PAINT, t);
+
+  t = statNow();
+  editorWriteOut(ab.b, ab.len);
+  statEnd(STAT_WRITE, t);
+  if (ST.input_at && ST.on) statRecord(STAT_TOTAL, statNow() - ST.input_at);
+  ST.input_at = 0;
+  E.frame_bytes = ab.len;
+  E.total_bytes += ab.len;
+  E.frames++;
+  E.redraw = 0;
+  E.last_frame = editorNow();
   abFree(&ab);
 }
 
@@ -676,31 +5441,54 @@ void editorSetStatusMessage(const char *fmt, ...) {
 }
 
 /*** input ***/
+// background work woke the event loop up. Returns 1 if the screen needs to be redrawn
+int editorIdle() {
+  int redraw = savePoll(0);
+  if (E.searching && searchPoll()) redraw = 1;
+  return redraw;
+}
+
 char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
   size_t bufsize = 128;
   char *buf = malloc(bufsize);
 
   size_t buflen = 0;
   buf[0] = '\0';
+  E.prompting = 1;
 
   while (1) {
     editorSetStatusMessage(prompt, buf);
-    editorRefreshScreen();
+    E.redraw = 1;
 
     int c = editorReadKey();
     if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
       if (buflen != 0) buf[--buflen] = '\0';
     } else if (c == '\x1b') {
       editorSetStatusMessage("");
+      E.prompting = 0;
       if (callback) callback(buf, c);
       free(buf);
       return NULL;
     } else if (c == '\r') {
       if (buflen != 0) {
         editorSetStatusMessage("");
+        E.prompting = 0;
         if (callback) callback(buf, c);
         return buf;
       }
+    } else if (c == PASTE_START) {
+      int len, j;
+      char *text = editorReadPaste(&len);
+      for (j = 0; j < len && text[j] != '\r' && text[j] != '\n'; j++) {
+        if (iscntrl((unsigned char)text[j]) || (unsigned char)text[j] >= 128) continue;
+        if (buflen == bufsize - 1) {
+          bufsize *= 2;
+          buf = realloc(buf, bufsize);
+        }
+        buf[buflen++] = text[j];
+      }
+      buf[buflen] = '\0';
+      free(text);
     } else if (!iscntrl(c) && c < 128) {
       if (buflen == bufsize - 1) {
         bufsize *= 2;
@@ -715,22 +5503,32 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
 void editorMoveCursor(int key)
 {
-  erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  erow *row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
 
   switch (key)
   {
   case ARROW_LEFT:
     if (E.cx != 0) 
     {
-      E.cx--;
+      unsigned cp;
+      do { // back over marks to the character they're on
+        E.cx = editorRowCharStart(row, E.cx - 1);
+        editorRowDecode(row, E.cx, &cp);
+      } while (E.cx > 0 && charWidth(cp) == 0);
     } else if (E.cy > 0) { // allow user to move to prev line if at start of a later line
         E.cy--;
-        E.cx = E.row[E.cy].size;
+        E.cx = editorRowAt(E.cy) -> size;
     }
     break;
   case ARROW_RIGHT:
     if (row && E.cx < row -> size) {
-      E.cx++;
+      unsigned cp;
+      E.cx += editorRowDecode(row, E.cx, &cp);
+      while (E.cx < row -> size) { // and over the marks on it
+        int n = editorRowDecode(row, E.cx, &cp);
+        if (charWidth(cp)) break;
+        E.cx += n;
+      }
     } else if (row && E.cx == row->size) {
         E.cy++;
         E.cx = 0;
@@ -750,12 +5548,13 @@ void editorMoveCursor(int key)
     break;
   }
 
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
   int rowlen = row ? row -> size : 0;
   if (E.cx > rowlen)
   {
     E.cx = rowlen;
   }
+  if (row && E.cx < rowlen) E.cx = editorRowCharStart(row, E.cx); // not in the middle of a character
 }
 
 void editorProcessKeypress()
@@ -763,6 +5562,7 @@ void editorProcessKeypress()
   static int quit_times = KILO_QUIT_TIMES;
 
   int c = editorReadKey();
+  long long t = statNow(), excluded = ST.excluded; // prompts read more keys, and draw frames
 
   switch(c)
   {
@@ -777,6 +5577,8 @@ void editorProcessKeypress()
         quit_times--;
         return;
       }
+      savePoll(1); // let a save in flight finish first
+      journalClose();
       write(STDOUT_FILENO, "\x1b[2J", 4);
       write(STDOUT_FILENO, "\x1b[H", 3);
       exit(0);
@@ -792,13 +5594,30 @@ void editorProcessKeypress()
 
     case END_KEY:
       if (E.cy < E.numrows)
-        E.cx = E.row[E.cy].size;
+        E.cx = editorRowAt(E.cy) -> size;
       break;
 
     case CTRL_KEY('f'):
       editorFind();
       break;
 
+    case CTRL_KEY('z'):
+      editorUndo();
+      break;
+
+    case PASTE_START:
+      {
+        int len;
+        char *text = editorReadPaste(&len);
+        editorInsertText(text, len);
+        free(text);
+      }
+      break;
+
+    case CTRL_KEY('y'):
+      editorRedo();
+      break;
+
     case BACKSPACE:
     case CTRL_KEY('h'):
     case DEL_KEY:
@@ -829,7 +5648,41 @@ void editorProcessKeypress()
       editorMoveCursor(c);
       break;
 
+    case CTRL_KEY('w'):
+      followToggle();
+      break;
+
+    case CTRL_KEY('p'):
+      statToggle();
+      editorSetStatusMessage(ST.on ? "Latency stats on, Ctrl-G dumps them to a file" : "Latency stats off");
+      break;
+
+    case CTRL_KEY('g'):
+      {
+        char *filename = editorPrompt("Dump latency stats to: %s (ESC to cancel)", NULL);
+        if (filename == NULL) break;
+        if (statDump(filename) == -1)
+          editorSetStatusMessage("Can't write %s: %s", filename, strerror(errno));
+        else
+          editorSetStatusMessage("Latency stats written to %s", filename);
+        free(filename);
+      }
+      break;
+
+    case CTRL_KEY('k'):
+      coldStatus();
+      break;
+
+    case CTRL_KEY('d'):
+      internStatus();
+      break;
+
     case CTRL_KEY('l'):
+      editorSetStatusMessage("Redrawn. Last frame %d bytes, %lld bytes in %d frames",
+        E.frame_bytes, E.total_bytes, E.frames);
+      editorInvalidateScreen();
+      break;
+
     case '\x1b':
       break;
 
@@ -839,7 +5692,374 @@ void editorProcessKeypress()
   }
 
   quit_times = KILO_QUIT_TIMES;
+  if (t && ST.on) statRecord(STAT_KEY, statNow() - t - (ST.excluded - excluded));
+}
+
+/*** headless ***/
+#ifdef KILO_HEADLESS
+// make kilo-headless builds an editor that runs against a terminal that only
+// exists in memory and replays a list of operations, each one a run of
+// keystrokes. An operation is timed from its first key until its frame has
+// been drawn and whatever background work it started (a search, a save) is
+// done. See editorHeadless() for the command line.
+
+// The virtual terminal understands the escape sequences the editor emits, so
+// the screen a run ends on can be printed and compared
+struct vterm {
+  int rows, cols;
+  char *cells; // rows * cols, row by row
+  int cy, cx; // cursor, 0-based
+  int top, bottom; // scrolling region, rows [top, bottom]
+  int state; // 0: text, 1: after <esc>, 2: inside <esc>[
+  char seq[32]; // parameters of the <esc>[ sequence so far
+  int seqlen;
+};
+
+struct vterm VT;
+
+typedef struct benchop {
+  char *keys;
+  int len;
+} benchop;
+
+struct bench {
+  benchop *ops;
+  int nops, cap;
+  int op, pos; // operation being replayed, and how many of its keys were handed out
+  double start;
+  double *lat; // ms taken by each finished operation
+  int *bytes; // bytes of the frame each operation ended with
+  double open_ms;
+  int open_bytes;
+  int screen; // print the screen at the end
+};
+
+struct bench B;
+
+void vtSize(int *rows, int *cols) {
+  *rows = VT.rows;
+  *cols = VT.cols;
+}
+
+static void vtClear(int y, int from, int to) {
+  if (from < to) memset(&VT.cells[y * VT.cols + from], ' ', to - from);
+}
+
+// shift the scrolling region up n lines (down if n is negative), blanking the lines exposed
+static void vtScroll(int n) {
+  int h = VT.bottom - VT.top + 1, y;
+  char *base = &VT.cells[VT.top * VT.cols];
+  if (n > h) n = h;
+  if (n < -h) n = -h;
+  if (n > 0) {
+    memmove(base, base + n * VT.cols, (h - n) * VT.cols);
+    for (y = VT.bottom - n + 1; y <= VT.bottom; y++) vtClear(y, 0, VT.cols);
+  } else if (n < 0) {
+    memmove(base - n * VT.cols, base, (h + n) * VT.cols);
+    for (y = VT.top; y < VT.top - n; y++) vtClear(y, 0, VT.cols);
+  }
+}
+
+static void vtCsi(int cmd) {
+  int p[2] = {0, 0}, np = 0, y;
+  char *s = VT.seq;
+  if (*s == '?') return; // private modes: cursor visibility, bracketed paste
+  while (np < 2) {
+    p[np++] = strtol(s, &s, 10);
+    if (*s++ != ';') break;
+  }
+  switch (cmd) {
+    case 'H':
+      VT.cy = p[0] > 0 ? (p[0] <= VT.rows ? p[0] : VT.rows) - 1 : 0;
+      VT.cx = p[1] > 0 ? (p[1] <= VT.cols ? p[1] : VT.cols) - 1 : 0;
+      break;
+    case 'K': vtClear(VT.cy, VT.cx, VT.cols); break;
+    case 'J':
+      if (p[0] == 2) for (y = 0; y < VT.rows; y++) vtClear(y, 0, VT.cols);
+      break;
+    case 'r':
+      VT.top = p[0] > 0 ? p[0] - 1 : 0;
+      VT.bottom = np > 1 && p[1] > 0 && p[1] <= VT.rows ? p[1] - 1 : VT.rows - 1;
+      VT.cy = VT.cx = 0;
+      break;
+    case 'S': vtScroll(p[0] > 0 ? p[0] : 1); break;
+    case 'T': vtScroll(p[0] > 0 ? -p[0] : -1); break;
+    // anything else (colors, cursor queries) doesn't change what's on the screen
+  }
+}
+
+void vtWrite(const char *buf, int len) {
+  int j;
+  for (j = 0; j < len; j++) {
+    int c = (unsigned char)buf[j];
+    if (VT.state == 1) {
+      VT.state = c == '[' ? 2 : 0;
+      VT.seqlen = 0;
+    } else if (VT.state == 2) {
+      if (isdigit(c) || c == ';' || c == '?') {
+        if (VT.seqlen < (int)sizeof(VT.seq) - 1) VT.seq[VT.seqlen++] = c;
+      } else {
+        VT.seq[VT.seqlen] = '\0';
+        vtCsi(c);
+        VT.state = 0;
+      }
+    } else if (c == '\x1b') {
+      VT.state = 1;
+    } else if (c == '\r') {
+      VT.cx = 0;
+    } else if (c == '\n') {
+      if (VT.cy == VT.bottom) vtScroll(1);
+      else if (VT.cy < VT.rows - 1) VT.cy++;
+    } else if (VT.cx < VT.cols) {
+      VT.cells[VT.cy * VT.cols + VT.cx++] = c;
+    }
+  }
+}
+
+static void vtDump() {
+  int y;
+  for (y = 0; y < VT.rows; y++) {
+    int len = VT.cols;
+    while (len > 0 && VT.cells[y * VT.cols + len - 1] == ' ') len--;
+    printf("%.*s\n", len, &VT.cells[y * VT.cols]);
+  }
+}
+
+static void benchAdd(const char *keys, int len) {
+  if (B.nops == B.cap) {
+    B.cap = B.cap ? B.cap * 2 : 64;
+    B.ops = realloc(B.ops, sizeof(benchop) * B.cap);
+  }
+  B.ops[B.nops].keys = malloc(len ? len : 1);
+  memcpy(B.ops[B.nops].keys, keys, len);
+  B.ops[B.nops].len = len;
+  B.nops++;
+}
+
+// the keys of the operation being replayed, as much as fits in buf. 0 once they're used up
+int benchInput(unsigned char *buf, int size) {
+  if (B.op < 0 || B.op >= B.nops) return 0;
+  int n = B.ops[B.op].len - B.pos;
+  if (n > size) n = size;
+  memcpy(buf, &B.ops[B.op].keys[B.pos], n);
+  B.pos += n;
+  return n;
+}
+
+static int benchBusy() {
+  return SJ.active || (SP.nparts && __atomic_load_n(&SP.ndone, __ATOMIC_ACQUIRE) < SP.nparts);
+}
+
+static int dblCmp(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void benchReport() {
+  int j, n = B.nops, maxbytes = 0;
+  long long total = 0;
+  struct rusage ru;
+  qsort(B.lat, n, sizeof(double), dblCmp);
+  for (j = 0; j < n; j++) {
+    total += B.bytes[j];
+    if (B.bytes[j] > maxbytes) maxbytes = B.bytes[j];
+  }
+  getrusage(RUSAGE_SELF, &ru);
+
+  printf("%s: %d lines, %dx%d terminal\n", E.filename ? E.filename : "[No Name]", E.numrows, VT.rows, VT.cols);
+  printf("open      %10.3f ms %9d bytes\n", B.open_ms, B.open_bytes);
+  if (n)
+    printf("%-6d ops p50 %.3f ms  p99 %.3f ms  max %.3f ms\n", n, B.lat[n / 2],
+        B.lat[(long long)n * 99 / 100], B.lat[n - 1]);
+  if (n)
+    printf("frames    avg %.1f bytes  max %d bytes  total %lld bytes\n", (double)total / n, maxbytes, total);
+  printf("peak RSS  %ld KB\n", ru.ru_maxrss);
+  if (CS.budget)
+    printf("rows      %.1f MB of %lld MB, %d warm chunks, %d blocks %.1f MB (%.1fx), %lld hits %lld misses %lld thaws\n",
+        coldResident() / 1048576.0, CS.budget >> 20, CS.warm, CS.zblocks, CS.zbytes / 1048576.0,
+        CS.zbytes ? (double)CS.zraw / CS.zbytes : 0.0, CS.hits, CS.misses, CS.thaws);
+  if (IT.on)
+    printf("intern    %lld rows share %d lines (%.1fx), %.1f MB saved\n",
+        IT.rows, IT.nlines, IT.nlines ? (double)IT.rows / IT.nlines : 0.0, internSaved() / 1048576.0);
+  if (J.records)
+    printf("journal   %lld edits in %lld bytes, %.2f bytes per edit\n", J.records, J.bytes, (double)J.bytes / J.records);
+  if (B.screen) vtDump();
+}
+
+// Stands in for editorWait(). Once the keys of the operation being replayed
+// have all been handled, waits for the background work, draws the frame and
+// starts on the next operation
+void benchWait() {
+  if (B.op >= 0 && B.pos < B.ops[B.op].len) {
+    inputFill(0);
+    return;
+  }
+
+  while (benchBusy()) {
+    struct pollfd pfd = {wakefd[0], POLLIN, 0};
+    char buf[64];
+    poll(&pfd, 1, 100);
+    while (read(wakefd[0], buf, sizeof(buf)) > 0);
+    if (editorIdle()) E.redraw = 1;
+  }
+  if (editorIdle()) E.redraw = 1;
+  E.frame_bytes = 0;
+  if (E.redraw) editorRefreshScreen();
+  coldTrim();
+  if (B.op >= 0) {
+    B.lat[B.op] = (benchNow() - B.start) * 1e3;
+    B.bytes[B.op] = E.frame_bytes;
+  }
+
+  if (++B.op == B.nops) {
+    journalClose();
+    benchReport();
+    exit(0);
+  }
+  B.pos = 0;
+  B.start = benchNow();
+  inputFill(0);
+}
+
+// One operation per line, with \r, \n, \t, \e, \\ and \xNN escapes. A line
+// "*N" repeats the operation before it N more times, lines starting with #
+// are comments
+static int benchScript(const char *filename) {
+  FILE *fp = fopen(filename, "r");
+  if (!fp) return -1;
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    int j, n = 0;
+    while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) linelen--;
+    line[linelen] = '\0';
+    if (linelen == 0 || line[0] == '#') continue;
+    if (line[0] == '*') {
+      int repeat = atoi(&line[1]);
+      while (B.nops && repeat-- > 0) benchAdd(B.ops[B.nops - 1].keys, B.ops[B.nops - 1].len);
+      continue;
+    }
+    for (j = 0; j < linelen; j++) { // unescaped in place, it only gets shorter
+      char c = line[j];
+      if (c == '\\' && j + 1 < linelen) {
+        c = line[++j];
+        if (c == 'r') c = '\r';
+        else if (c == 'n') c = '\n';
+        else if (c == 't') c = '\t';
+        else if (c == 'e') c = '\x1b';
+        else if (c == 'x' && j + 2 < linelen && isxdigit((unsigned char)line[j + 1]) && isxdigit((unsigned char)line[j + 2])) {
+          char hex[3] = {line[j + 1], line[j + 2], '\0'};
+          c = strtol(hex, NULL, 16);
+          j += 2;
+        }
+      }
+      line[n++] = c;
+    }
+    benchAdd(line, n);
+  }
+  free(line);
+  fclose(fp);
+  return 0;
+}
+
+// the bundled scenarios. Returns 0 for an unknown name
+static int benchScenario(const char *name) {
+  int j, k;
+  if (strcmp(name, "open") == 0) { // page through the start of the file
+    for (j = 0; j < 200; j++) benchAdd("\x1b[6~", 4);
+  } else if (strcmp(name, "type-top") == 0) { // type at the top of the file, so every row below moves
+    const char *text = "the quick brown fox jumps over the lazy dog ";
+    for (j = 0; j < 2000; j++) benchAdd(j % 60 == 59 ? "\r" : &text[j % strlen(text)], 1);
+  } else if (strcmp(name, "paste") == 0) { // bracketed pastes of 10000 lines, then undo and redo them all
+    struct abuf ab = ABUF_INIT;
+    char buf[80];
+    abAppend(&ab, "\x1b[200~", 6);
+    for (j = 0; j < 10000; j++) {
+      int len = snprintf(buf, sizeof(buf), "pasted line %d, with a few words to make it longer\n", j);
+      abAppend(&ab, buf, len);
+    }
+    abAppend(&ab, "\x1b[201~", 6);
+    for (j = 0; j < 10; j++) benchAdd(ab.b, ab.len);
+    for (j = 0; j < 10; j++) benchAdd("\x1a", 1);
+    for (j = 0; j < 10; j++) benchAdd("\x19", 1);
+    abFree(&ab);
+  } else if (strcmp(name, "search") == 0) { // incremental searches, stepping through a few matches
+    const char *queries[] = {"the", "int", "zqxj", "\x12[0-9]+x"}; // the last one turns on regex mode first
+    for (j = 0; j < (int)(sizeof(queries) / sizeof(queries[0])); j++) {
+      benchAdd("\x06", 1);
+      for (k = 0; queries[j][k]; k++) benchAdd(&queries[j][k], 1);
+      for (k = 0; k < 3; k++) benchAdd("\x1b[B", 3);
+      benchAdd("\r", 1);
+    }
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+// kilo-headless [--size ROWSxCOLS] [--screen] [--budget MB] [--intern] --scenario NAME|--script FILE [FILE]
+int editorHeadless(int argc, char *argv[]) {
+  int j, rows = 24, cols = 80;
+  const char *scenario = NULL, *script = NULL;
+  char *filename = NULL;
+  for (j = 1; j < argc; j++) {
+    if (strcmp(argv[j], "--size") == 0 && j + 1 < argc) {
+      if (sscanf(argv[++j], "%dx%d", &rows, &cols) != 2 || rows < 3 || cols < 1) break;
+    } else if (strcmp(argv[j], "--screen") == 0) {
+      B.screen = 1;
+    } else if (strcmp(argv[j], "--budget") == 0 && j + 1 < argc) {
+      CS.budget = atoll(argv[++j]) << 20;
+    } else if (strcmp(argv[j], "--intern") == 0) {
+      IT.on = 1;
+    } else if (strcmp(argv[j], "--scenario") == 0 && j + 1 < argc) {
+      scenario = argv[++j];
+    } else if (strcmp(argv[j], "--script") == 0 && j + 1 < argc) {
+      script = argv[++j];
+    } else if (argv[j][0] != '-' && !filename) {
+      filename = argv[j];
+    } else {
+      break;
+    }
+  }
+  if (j < argc || !scenario == !script) {
+    fprintf(stderr, "usage: %s [--size ROWSxCOLS] [--screen] [--budget MB] [--intern] --scenario open|type-top|paste|search|--script FILE [FILE]\n", argv[0]);
+    return 1;
+  }
+  if (script && benchScript(script) == -1) {
+    perror(script);
+    return 1;
+  }
+  if (scenario && !benchScenario(scenario)) {
+    fprintf(stderr, "no scenario called %s\n", scenario);
+    return 1;
+  }
+
+  VT.rows = rows;
+  VT.cols = cols;
+  VT.cells = malloc(rows * cols);
+  memset(VT.cells, ' ', rows * cols);
+  VT.bottom = rows - 1;
+  B.lat = malloc(sizeof(double) * (B.nops + 1));
+  B.bytes = malloc(sizeof(int) * (B.nops + 1));
+  B.op = -1;
+
+  initEditor();
+  double t = benchNow();
+  if (filename) editorOpen(filename);
+  if (E.statusmsg[0] == '\0') // editorOpen() may have had something to say
+    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-Z/Y = undo/redo");
+  editorRefreshScreen();
+  B.open_ms = (benchNow() - t) * 1e3;
+  B.open_bytes = E.frame_bytes;
+
+  while (1) {
+    E.redraw = 1;
+    editorProcessKeypress();
+  }
+  return 0;
 }
+#endif
 
 /*** init ***/
 
@@ -851,30 +6071,67 @@ void initEditor()
   E.rowoff = 0; // by default, scrolled to top of file
   E.coloff = 0;
   E.numrows = 0;
-  E.row = NULL;
+  E.root = E.head = E.tail = NULL;
+  E.map = NULL;
+  E.maplen = 0;
+  E.lineoff = NULL;
+  E.nlines = 0;
   E.dirty = 0;
   E.filename = NULL;
+  E.searching = 0;
+  E.prompting = 0;
+  E.search_icase = 0;
+  E.search_regex = 0;
+  E.syntax = NULL;
   E.statusmsg[0] = '\0'; // initialize to an empty string so no message displayed by default
   E.statusmsg_time = 0; // will contain time stamp when set by a status message
 
   if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
   E.screenrows -= 2; // save last 2 lines for status bar and messages
+
+  E.shadow = calloc(E.screenrows + 2, sizeof(screenline));
+  editorInvalidateScreen();
+  E.frame_bytes = E.frames = 0;
+  E.total_bytes = 0;
+
+  rcacheReserve(E.screenrows * 4 > KILO_RENDER_CACHE ? E.screenrows * 4 : KILO_RENDER_CACHE);
+
+  if (pipe2(wakefd, O_NONBLOCK | O_CLOEXEC) == -1) die("pipe2");
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = editorHandleWinch;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGWINCH, &sa, NULL);
 }
 
 int main(int argc, char *argv[]) 
 {
+#ifdef KILO_HEADLESS
+  return editorHeadless(argc, argv);
+#endif
+  if (argc >= 4 && strcmp(argv[1], "--bench-search") == 0) return editorBenchSearch(argv[2], argv[3]);
+  if (argc >= 3 && strcmp(argv[1], "--bench-open") == 0) return editorBenchOpen(argv[2], argc >= 4 ? atoi(argv[3]) : 0);
+  int j, follow = 0;
+  for (j = 1; j < argc - 1; j++) { // options come before the file
+    if (strcmp(argv[j], "--follow") == 0) follow = 1;
+    else if (strcmp(argv[j], "--budget") == 0 && j + 2 < argc) CS.budget = atoll(argv[++j]) << 20;
+    else if (strcmp(argv[j], "--intern") == 0) IT.on = 1;
+    else break;
+  }
   enableRawMode();
   initEditor();
-  if (argc >= 2)
+  if (j < argc)
   { 
-    editorOpen(argv[1]);
+    editorOpen(argv[j]);
   }
 
-  editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+  if (E.statusmsg[0] == '\0') // editorOpen() may have had something to say
+    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-Z/Y = undo/redo");
+  if (follow) followToggle();
 
-  while(1) //reads input character by character till q is pressed
+  while(1) // keys are handled as they come, the screen is redrawn once the input runs dry, see editorWait()
   {
-    editorRefreshScreen();
+    E.redraw = 1;
     editorProcessKeypress();
   }
   return 0;